@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+
+/*
+ * Allocator benchmark suite.
+ * Runs a set of standard workloads against sfmm and glibc malloc and prints, for each pair:
+ *   - throughput: allocator calls per second over all threads,
+ *   - latency: 50th, 99th and 99.9th percentile of one call, timed on one call in SAMPLE_EVERY at random,
+ *   - memory: most bytes ever live (as requested) next to the growth of the resident set, and their ratio.
+ * Every run happens in a child process of its own, so that neither allocator sees the other's heap and the
+ * resident set only counts that run.
+ *
+ * usage: sfmm_bench_suite [threads] [ops_per_thread] [workload...]
+ * workloads: fixed random prodcons realloc larson xmalloc (all by default)
+ */
+
+#define SAMPLE_EVERY 16                 // Power of two.
+#define SLOTS 1000                      // Live blocks per thread in the churn workloads.
+#define RING_SIZE 1024                  // Blocks in flight between a producer and its consumer.
+#define BATCH_SIZE 64                   // Blocks per batch in xmalloc.
+#define MAX_BATCHES 1024                // Batches queued before xmalloc producers wait.
+
+struct allocator {
+    const char* name;
+    void* (*allocate)(size_t size);
+    void (*release)(void* ptr);
+    void* (*reallocate)(void* ptr, size_t size);
+};
+
+static const struct allocator allocators[] = {
+    {"sfmm", sf_malloc, sf_free, sf_realloc},
+    {"glibc", malloc, free, realloc},
+};
+
+static const struct allocator* allocator;  // One under test, set in the child.
+static int num_threads = 4;
+static long ops_per_thread = 1000000;
+
+/*
+ * State of one thread. Latency samples are kept in nanoseconds. Live bytes are counted locally and added
+ * to the shared count every few calls, or as soon as they grow by a lot, so that counting does not serialize
+ * the threads.
+ */
+struct worker {
+    int index;
+    unsigned int seed;
+    long calls;
+    unsigned int sample_seed;           // Picks the timed calls, so they do not line up with a workload's pattern.
+    uint32_t* samples;
+    size_t num_samples;
+    long live;                          // Not yet added to live_bytes.
+    void* data;                         // Per workload.
+};
+
+static struct worker* workers;
+static size_t max_samples;              // Per worker.
+static long live_bytes;
+static long peak_live_bytes;
+
+static uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void add_live(struct worker* worker, long bytes) {
+    worker -> live += bytes;
+    if ((worker -> calls & 63) == 0 || bytes == 0 || worker -> live > 65536) {
+        long live = __atomic_add_fetch(&live_bytes, worker -> live, __ATOMIC_RELAXED);
+        worker -> live = 0;
+        long peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+        while (live > peak && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1, __ATOMIC_RELAXED,
+                                                           __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+/*
+ * Counts a call.
+ *
+ * @return 1 if the call is to be timed.
+ */
+static int timed(struct worker* worker) {
+    worker -> calls++;
+    return (rand_r(&worker -> sample_seed) & (SAMPLE_EVERY - 1)) == 0;
+}
+
+static void add_sample(struct worker* worker, uint64_t start) {
+    if (worker -> num_samples < max_samples) {
+        worker -> samples[worker -> num_samples++] = now() - start;
+    }
+}
+
+/*
+ * Allocator calls of the workloads. Each one touches the block, as a program would.
+ */
+static void* bench_malloc(struct worker* worker, size_t size) {
+    void* ptr;
+    if (timed(worker)) {
+        uint64_t start = now();
+        ptr = allocator -> allocate(size);
+        add_sample(worker, start);
+    }
+    else {
+        ptr = allocator -> allocate(size);
+    }
+    if (ptr == NULL) {
+        fprintf(stderr, "%s: out of memory\n", allocator -> name);
+        exit(1);
+    }
+    *(char*)ptr = 1;
+    add_live(worker, size);
+    return ptr;
+}
+
+static void bench_free(struct worker* worker, void* ptr, size_t size) {
+    if (timed(worker)) {
+        uint64_t start = now();
+        allocator -> release(ptr);
+        add_sample(worker, start);
+    }
+    else {
+        allocator -> release(ptr);
+    }
+    add_live(worker, -(long)size);
+}
+
+static void* bench_realloc(struct worker* worker, void* ptr, size_t old_size, size_t size) {
+    void* new_ptr;
+    if (timed(worker)) {
+        uint64_t start = now();
+        new_ptr = allocator -> reallocate(ptr, size);
+        add_sample(worker, start);
+    }
+    else {
+        new_ptr = allocator -> reallocate(ptr, size);
+    }
+    if (new_ptr == NULL) {
+        fprintf(stderr, "%s: out of memory\n", allocator -> name);
+        exit(1);
+    }
+    ((char*)new_ptr)[size - 1] = 1;
+    add_live(worker, (long)size - (long)old_size);
+    return new_ptr;
+}
+
+/*
+ * @return a size from 16 to 4095 bytes, small sizes being as likely as large ones on a log scale.
+ */
+static size_t random_size(struct worker* worker) {
+    size_t size = (size_t)16 << (rand_r(&worker -> seed) % 8);
+    return size + rand_r(&worker -> seed) % size;
+}
+
+/*
+ * Churn: every thread keeps up to SLOTS blocks and repeatedly frees a random one or fills an empty one.
+ */
+static void churn(struct worker* worker, int fixed) {
+    void* blocks[SLOTS] = {NULL};
+    size_t sizes[SLOTS];
+    for (long i = 0; i < ops_per_thread; i++) {
+        int slot = rand_r(&worker -> seed) % SLOTS;
+        if (blocks[slot] != NULL) {
+            bench_free(worker, blocks[slot], sizes[slot]);
+            blocks[slot] = NULL;
+        }
+        else {
+            sizes[slot] = fixed ? 64 : random_size(worker);
+            blocks[slot] = bench_malloc(worker, sizes[slot]);
+        }
+    }
+    for (int slot = 0; slot < SLOTS; slot++) {
+        if (blocks[slot] != NULL) {
+            bench_free(worker, blocks[slot], sizes[slot]);
+        }
+    }
+}
+
+static void* fixed_churn(void* arg) {
+    churn(arg, 1);
+    return NULL;
+}
+
+static void* random_churn(void* arg) {
+    churn(arg, 0);
+    return NULL;
+}
+
+/*
+ * Producer/consumer: threads are paired, the even one allocates and passes blocks through a ring to the
+ * odd one, which frees them. Every free is a free of another thread's block. Size is kept in the block.
+ */
+struct ring {
+    void* slots[RING_SIZE];
+    unsigned long head;                 // Next slot to read, only written by the consumer.
+    unsigned long tail;                 // Next slot to write, only written by the producer.
+};
+
+static void* producer_consumer(void* arg) {
+    struct worker* worker = arg;
+    struct ring* ring = workers[worker -> index & ~1].data;
+    if ((worker -> index & 1) == 0) {
+        for (long i = 0; i < ops_per_thread; i++) {
+            size_t size = 16 + rand_r(&worker -> seed) % 497;
+            size_t* block = bench_malloc(worker, size);
+            block[0] = size;
+            while (ring -> tail - __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+                sched_yield();
+            }
+            ring -> slots[ring -> tail % RING_SIZE] = block;
+            __atomic_store_n(&ring -> tail, ring -> tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else {
+        for (long i = 0; i < ops_per_thread; i++) {
+            while (__atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) == ring -> head) {
+                sched_yield();
+            }
+            size_t* block = ring -> slots[ring -> head % RING_SIZE];
+            __atomic_store_n(&ring -> head, ring -> head + 1, __ATOMIC_RELEASE);
+            bench_free(worker, block, block[0]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Realloc doubling: a buffer grows from 16 bytes to 256 KB by doubling, like a growing string or vector.
+ */
+static void* realloc_doubling(void* arg) {
+    struct worker* worker = arg;
+    for (long i = 0; i < ops_per_thread; i += 16) {
+        size_t size = 16;
+        char* buffer = bench_malloc(worker, size);
+        for (; size < 256 * 1024; size *= 2) {
+            buffer = bench_realloc(worker, buffer, size, size * 2);
+        }
+        bench_free(worker, buffer, size);
+    }
+    return NULL;
+}
+
+/*
+ * Larson: a server whose threads each own SLOTS blocks of 10 to 1000 bytes and keep replacing random ones.
+ * Work is done in rounds of new threads, each taking over the blocks of a thread of the previous round, so
+ * most frees are of blocks another thread allocated.
+ */
+#define LARSON_ROUNDS 4
+
+struct larson_slots {
+    void* blocks[SLOTS];
+    size_t sizes[SLOTS];
+};
+
+static void* larson(void* arg) {
+    struct worker* worker = arg;
+    struct larson_slots* slots = worker -> data;
+    for (long i = 0; i < ops_per_thread / LARSON_ROUNDS / 2; i++) {
+        int slot = rand_r(&worker -> seed) % SLOTS;
+        if (slots -> blocks[slot] != NULL) {
+            bench_free(worker, slots -> blocks[slot], slots -> sizes[slot]);
+        }
+        slots -> sizes[slot] = 10 + rand_r(&worker -> seed) % 991;
+        slots -> blocks[slot] = bench_malloc(worker, slots -> sizes[slot]);
+    }
+    return NULL;
+}
+
+/*
+ * xmalloc-test: half of the threads allocate batches of blocks and queue them, the other half takes any
+ * batch and frees it, so blocks move between threads at random. Batches are allocated like the blocks.
+ */
+struct batch {
+    struct batch* next;
+    void* blocks[BATCH_SIZE];
+    size_t sizes[BATCH_SIZE];
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static struct batch* queue;
+static int queued;
+static int producers_left;
+
+static void* xmalloc(void* arg) {
+    struct worker* worker = arg;
+    if ((worker -> index & 1) == 0) {
+        for (long i = 0; i < ops_per_thread; i += BATCH_SIZE + 1) {
+            struct batch* batch = bench_malloc(worker, sizeof(struct batch));
+            for (int j = 0; j < BATCH_SIZE; j++) {
+                batch -> sizes[j] = 16 + rand_r(&worker -> seed) % 113;
+                batch -> blocks[j] = bench_malloc(worker, batch -> sizes[j]);
+            }
+            pthread_mutex_lock(&queue_lock);
+            while (queued >= MAX_BATCHES) {
+                pthread_cond_wait(&queue_changed, &queue_lock);
+            }
+            batch -> next = queue;
+            queue = batch;
+            queued++;
+            pthread_cond_broadcast(&queue_changed);
+            pthread_mutex_unlock(&queue_lock);
+        }
+        pthread_mutex_lock(&queue_lock);
+        producers_left--;
+        pthread_cond_broadcast(&queue_changed);
+        pthread_mutex_unlock(&queue_lock);
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue == NULL && producers_left > 0) {
+            pthread_cond_wait(&queue_changed, &queue_lock);
+        }
+        struct batch* batch = queue;
+        if (batch != NULL) {
+            queue = batch -> next;
+            queued--;
+            pthread_cond_broadcast(&queue_changed);
+        }
+        pthread_mutex_unlock(&queue_lock);
+        if (batch == NULL) {
+            return NULL;
+        }
+        for (int j = 0; j < BATCH_SIZE; j++) {
+            bench_free(worker, batch -> blocks[j], batch -> sizes[j]);
+        }
+        bench_free(worker, batch, sizeof(struct batch));
+    }
+}
+
+struct workload {
+    const char* name;
+    void* (*run)(void* worker);
+    int paired;                         // Needs an even number of threads.
+};
+
+static const struct workload workloads[] = {
+    {"fixed", fixed_churn, 0},
+    {"random", random_churn, 0},
+    {"prodcons", producer_consumer, 1},
+    {"realloc", realloc_doubling, 0},
+    {"larson", larson, 0},
+    {"xmalloc", xmalloc, 1},
+};
+
+static const struct workload* current;
+
+/*
+ * Thread entry: runs the workload, then adds what is left of the thread's live bytes.
+ */
+static void* thread_main(void* arg) {
+    current -> run(arg);
+    add_live(arg, 0);
+    return NULL;
+}
+
+struct result {
+    int ok;
+    double calls_per_second;
+    uint32_t p50, p99, p999;
+    long peak_live;
+    long resident;                      // Growth of the resident set during the run.
+};
+
+static int by_value(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a, right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+static long max_resident() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024L;
+}
+
+/*
+ * This method runs one workload on the allocator under test. Called in a child process.
+ */
+static void run(const struct workload* workload, int threads, struct result* result) {
+    workers = mmap(NULL, threads * sizeof(struct worker), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    max_samples = ops_per_thread * 2 / SAMPLE_EVERY + 16;
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].seed = i + 1;
+        workers[i].sample_seed = ~i;
+        workers[i].samples = mmap(NULL, max_samples * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        memset(workers[i].samples, 0, max_samples * sizeof(uint32_t));     // Part of the resident set already.
+        workers[i].data = calloc(1, workload -> run == larson ? sizeof(struct larson_slots) : sizeof(struct ring));
+    }
+    producers_left = threads / 2;
+    current = workload;
+
+    long resident_before = max_resident();
+    pthread_t ids[threads];
+    uint64_t start = now();
+    int rounds = workload -> run == larson ? LARSON_ROUNDS : 1;
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < threads; i++) {
+            pthread_create(&ids[i], NULL, thread_main, &workers[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    double seconds = (now() - start) / 1e9;
+    result -> resident = max_resident() - resident_before;
+
+    // Larson leaves its blocks for the next round, free them now.
+    size_t num_samples = 0;
+    for (int i = 0; i < threads; i++) {
+        if (workload -> run == larson) {
+            struct larson_slots* slots = workers[i].data;
+            for (int slot = 0; slot < SLOTS; slot++) {
+                if (slots -> blocks[slot] != NULL) {
+                    allocator -> release(slots -> blocks[slot]);
+                }
+            }
+        }
+        num_samples += workers[i].num_samples;
+    }
+
+    uint32_t* samples = mmap(NULL, num_samples * sizeof(uint32_t) + 1, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    long calls = 0;
+    num_samples = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(samples + num_samples, workers[i].samples, workers[i].num_samples * sizeof(uint32_t));
+        num_samples += workers[i].num_samples;
+        calls += workers[i].calls;
+    }
+    qsort(samples, num_samples, sizeof(uint32_t), by_value);
+
+    result -> ok = 1;
+    result -> calls_per_second = calls / seconds;
+    result -> p50 = num_samples > 0 ? samples[num_samples / 2] : 0;
+    result -> p99 = num_samples > 0 ? samples[num_samples * 99 / 100] : 0;
+    result -> p999 = num_samples > 0 ? samples[num_samples * 999 / 1000] : 0;
+    result -> peak_live = peak_live_bytes;
+}
+
+/*
+ * This method runs a workload in a child process and prints its line.
+ */
+static void report(const struct workload* workload, const struct allocator* tested) {
+    int threads = num_threads;
+    if (workload -> paired) {
+        threads = threads < 2 ? 2 : threads & ~1;
+    }
+
+    int channel[2];
+    struct result result = {0};
+    if (pipe(channel) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        close(channel[0]);
+        allocator = tested;
+        run(workload, threads, &result);
+        if (write(channel[1], &result, sizeof(result)) != sizeof(result)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(channel[1]);
+    if (read(channel[0], &result, sizeof(result)) != sizeof(result)) {
+        result.ok = 0;
+    }
+    close(channel[0]);
+    waitpid(child, NULL, 0);
+
+    if (!result.ok) {
+        printf("%-9s %-6s %3d  failed\n", workload -> name, tested -> name, threads);
+        return;
+    }
+    printf("%-9s %-6s %3d %10.2f %8u %8u %8u %10.2f %10.2f %8.2f\n", workload -> name, tested -> name, threads,
+           result.calls_per_second / 1e6, result.p50, result.p99, result.p999, result.peak_live / 1048576.0,
+           result.resident / 1048576.0, result.peak_live > 0 ? (double)result.resident / result.peak_live : 0);
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc > 1) num_threads = atoi(argv[1]);
+    if (argc > 2) ops_per_thread = atol(argv[2]);
+    if (num_threads < 1 || ops_per_thread < 1) {
+        fprintf(stderr, "usage: %s [threads] [ops_per_thread] [workload...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%ld ops per thread, latency in ns, memory in MB\n", ops_per_thread);
+    printf("%-9s %-6s %3s %10s %8s %8s %8s %10s %10s %8s\n", "workload", "alloc", "thr", "Mcalls/s", "p50", "p99",
+           "p99.9", "peak live", "resident", "ratio");
+    int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+    for (int i = 0; i < num_workloads; i++) {
+        int selected = argc <= 3;
+        for (int arg = 3; arg < argc; arg++) {
+            selected |= strcmp(argv[arg], workloads[i].name) == 0;
+        }
+        if (selected) {
+            report(&workloads[i], &allocators[0]);
+            report(&workloads[i], &allocators[1]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
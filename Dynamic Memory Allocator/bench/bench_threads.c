@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "sfmm.h"
+
+/*
+ * Multi-threaded throughput benchmark.
+ * Every thread keeps a few live blocks and repeatedly frees one and allocates a new one of random size,
+ * touching the first bytes of each block. Run is repeated with 1, 2, ... max_threads threads and the
+ * total number of operations per second is printed for each, next to the speedup over one thread.
+ *
+ * usage: sfmm_bench_threads [max_threads] [ops_per_thread] [min_size] [max_size]
+ */
+
+#define SLOTS 4                         // Live blocks per thread, the sfutil heap is only 16 pages.
+
+static long ops_per_thread = 200000;
+static size_t min_size = 200;           // Default range is served by the free lists, not the quick lists.
+static size_t max_size = 1000;
+
+struct worker_result {
+    long operations;
+    long failures;                      // sf_malloc returned NULL, heap was full at that moment.
+};
+
+static void* worker(void* arg) {
+    struct worker_result* result = arg;
+    unsigned int seed = (unsigned int)(size_t)arg;
+    char* slots[SLOTS] = {NULL};
+
+    for (long i = 0; i < ops_per_thread; i++) {
+        int slot = rand_r(&seed) % SLOTS;
+        if (slots[slot] != NULL) {
+            sf_free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = min_size + rand_r(&seed) % (max_size - min_size + 1);
+            slots[slot] = sf_malloc(size);
+            if (slots[slot] == NULL) {
+                result -> failures++;
+            } else {
+                memset(slots[slot], 0xab, 16);
+            }
+        }
+        result -> operations++;
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            sf_free(slots[slot]);
+        }
+    }
+    return NULL;
+}
+
+static double run(int threads) {
+    pthread_t ids[threads];
+    struct worker_result results[threads];
+    struct timespec start, end;
+
+    memset(results, 0, sizeof(results));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, worker, &results[i]);
+    }
+    long operations = 0, failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        operations += results[i].operations;
+        failures += results[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (failures > 0) {
+        fprintf(stderr, "%d threads: %ld allocations failed\n", threads, failures);
+    }
+    return operations / seconds;
+}
+
+int main(int argc, char const *argv[]) {
+    int max_threads = 8;
+    if (argc > 1) max_threads = atoi(argv[1]);
+    if (argc > 2) ops_per_thread = atol(argv[2]);
+    if (argc > 3) min_size = atol(argv[3]);
+    if (argc > 4) max_size = atol(argv[4]);
+    if (max_threads < 1 || min_size < 1 || max_size < min_size) {
+        fprintf(stderr, "usage: %s [max_threads] [ops_per_thread] [min_size] [max_size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("sizes %zu..%zu, %ld ops per thread\n", min_size, max_size, ops_per_thread);
+    printf("%8s %14s %8s\n", "threads", "ops/sec", "speedup");
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        double rate = run(threads);
+        if (threads == 1) {
+            single = rate;
+        }
+        printf("%8d %14.0f %8.2f\n", threads, rate, rate / single);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+/*
+ * Trace replay benchmark.
+ * Reads a trace written by an SF_TRACE build, orders its records by time and runs the same sequence of
+ * allocations and frees against sfmm, glibc malloc or both, on a single thread. Block addresses of the trace
+ * are turned into dense ids before the timed run, so replay itself only indexes an array. Timer is paused at
+ * the point where the most bytes are live, to sample how much memory the allocator holds at that moment.
+ *
+ * usage: sfmm_replay trace_file [sfmm|glibc|both]
+ */
+
+typedef struct replay_op {
+    uint64_t size;
+    uint32_t id;                        // Slot of the block allocated or freed.
+    uint32_t old_id;                    // SF_TRACE_REALLOC: slot of the block passed in, NO_ID if unknown.
+    uint32_t align;                     // SF_TRACE_MEMALIGN only.
+    uint32_t op;
+} replay_op;
+
+#define NO_ID 0xffffffffu
+
+/*
+ * Big arrays come from mmap() so that the glibc run starts with an arena the tool has not used.
+ */
+static void* map(size_t size) {
+    void* ptr = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static int by_time(const void* a, const void* b) {
+    const sf_trace_record* left = *(sf_trace_record* const*)a;
+    const sf_trace_record* right = *(sf_trace_record* const*)b;
+    if (left -> time != right -> time) {
+        return left -> time < right -> time ? -1 : 1;
+    }
+    return left < right ? -1 : left > right;        // Same time: keep file order, which is the order of one thread.
+}
+
+/*
+ * Table from block address to slot, open addressing. Entries are removed by marking them, which is enough
+ * since there are never more insertions than records.
+ */
+static uint64_t* table_keys;
+static uint32_t* table_ids;
+static size_t table_mask;
+
+#define TABLE_REMOVED 0xfffffffeu
+
+static size_t table_find(uint64_t address) {
+    size_t index = (address >> 4) * 0x9e3779b97f4a7c15ull & table_mask;
+    while (table_ids[index] != NO_ID && (table_ids[index] == TABLE_REMOVED || table_keys[index] != address)) {
+        index = (index + 1) & table_mask;
+    }
+    return index;
+}
+
+/*
+ * @return slot of the block at address, NO_ID if that address is not live. Entry is removed.
+ */
+static uint32_t table_take(uint64_t address) {
+    size_t index = table_find(address);
+    uint32_t id = table_ids[index];
+    if (id != NO_ID) {
+        table_ids[index] = TABLE_REMOVED;
+    }
+    return id;
+}
+
+static void table_put(uint64_t address, uint32_t id) {
+    size_t index = (address >> 4) * 0x9e3779b97f4a7c15ull & table_mask;
+    while (table_ids[index] != NO_ID && table_ids[index] != TABLE_REMOVED) {
+        index = (index + 1) & table_mask;
+    }
+    table_keys[index] = address;
+    table_ids[index] = id;
+}
+
+static replay_op* ops;
+static size_t num_ops;
+static uint32_t num_ids;
+static size_t peak_op;                  // Index of the op after which the most bytes are live.
+static size_t peak_live;
+
+/*
+ * This method reads the trace and turns it into ops.
+ */
+static void load(const char* path) {
+    FILE* file = fopen(path, "rb");
+    char magic[8];
+    if (file == NULL || fread(magic, 1, 8, file) != 8 || memcmp(magic, SF_TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    size_t num_records = (ftell(file) - 8) / sizeof(sf_trace_record);
+    fseek(file, 8, SEEK_SET);
+    sf_trace_record* records = map(num_records * sizeof(sf_trace_record));
+    num_records = fread(records, sizeof(sf_trace_record), num_records, file);
+    fclose(file);
+
+    sf_trace_record** order = map(num_records * sizeof(sf_trace_record*));
+    for (size_t i = 0; i < num_records; i++) {
+        order[i] = &records[i];
+    }
+    qsort(order, num_records, sizeof(sf_trace_record*), by_time);
+
+    size_t table_size = 16;
+    while (table_size < 2 * num_records) {
+        table_size <<= 1;
+    }
+    table_mask = table_size - 1;
+    table_keys = map(table_size * sizeof(uint64_t));
+    table_ids = map(table_size * sizeof(uint32_t));
+    memset(table_ids, 0xff, table_size * sizeof(uint32_t));
+    uint64_t* sizes = map(num_records * sizeof(uint64_t));
+
+    ops = map(num_records * sizeof(replay_op));
+    size_t live = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        sf_trace_record* record = order[i];
+        replay_op* op = &ops[num_ops];
+        op -> op = record -> op;
+        op -> size = record -> size;
+        op -> align = 0;
+        op -> old_id = NO_ID;
+
+        if (record -> op == SF_TRACE_FREE) {
+            op -> id = table_take(record -> id);
+            if (op -> id == NO_ID) {
+                continue;                       // Allocated before tracing started.
+            }
+            live -= sizes[op -> id];
+        }
+        else {
+            if (record -> op == SF_TRACE_REALLOC) {
+                op -> old_id = table_take(record -> arg);
+                if (op -> old_id != NO_ID) {
+                    live -= sizes[op -> old_id];
+                }
+            }
+            else if (record -> op == SF_TRACE_MEMALIGN) {
+                op -> align = record -> arg;
+            }
+            op -> id = num_ids++;
+            sizes[op -> id] = record -> size;
+            live += record -> size;
+            table_put(record -> id, op -> id);
+        }
+
+        if (live > peak_live) {
+            peak_live = live;
+            peak_op = num_ops;
+        }
+        num_ops++;
+    }
+
+    munmap(sizes, num_records * sizeof(uint64_t));
+    munmap(table_ids, table_size * sizeof(uint32_t));
+    munmap(table_keys, table_size * sizeof(uint64_t));
+    munmap(order, num_records * sizeof(sf_trace_record*));
+    munmap(records, num_records * sizeof(sf_trace_record));
+}
+
+struct allocator {
+    const char* name;
+    void* (*allocate)(size_t size);
+    void* (*allocate_zeroed)(size_t size);
+    void* (*reallocate)(void* ptr, size_t size);
+    void* (*allocate_aligned)(size_t size, size_t align);
+    void (*release)(void* ptr);
+    void (*sample)(size_t* footprint, double* fragmentation);
+};
+
+static void* glibc_calloc(size_t size) {
+    return calloc(1, size);
+}
+
+static void* glibc_memalign(size_t size, size_t align) {
+    return memalign(align, size);
+}
+
+/*
+ * Footprint is the arena plus mapped chunks, fragmentation the part of the arena that is free.
+ */
+static void glibc_sample(size_t* footprint, double* fragmentation) {
+    struct mallinfo2 info = mallinfo2();
+    *footprint = info.arena + info.hblkhd;
+    *fragmentation = info.arena > 0 ? (double)info.fordblks / info.arena : 0;
+}
+
+static void* sfmm_calloc(size_t size) {
+    return sf_calloc(1, size);
+}
+
+static void* sfmm_memalign(size_t size, size_t align) {
+    return sf_memalign(size, align < 32 ? 32 : align);
+}
+
+static void sfmm_sample(size_t* footprint, double* fragmentation) {
+    struct sf_stats stats;
+    sf_get_stats(&stats);
+    *footprint = stats.heap_bytes + stats.mapped_bytes;
+    *fragmentation = stats.fragmentation;
+}
+
+static const struct allocator allocators[] = {
+    {"sfmm", sf_malloc, sfmm_calloc, sf_realloc, sfmm_memalign, sf_free, sfmm_sample},
+    {"glibc", malloc, glibc_calloc, realloc, glibc_memalign, free, glibc_sample},
+};
+
+static double seconds(struct timespec* start, struct timespec* end) {
+    return (end -> tv_sec - start -> tv_sec) + (end -> tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+/*
+ * This method replays every op against one allocator and prints the results.
+ */
+static void replay(const struct allocator* allocator) {
+    void** blocks = map(((size_t)num_ids + 1) * sizeof(void*));
+    size_t failures = 0;
+    size_t footprint = 0;
+    double fragmentation = 0;
+    double elapsed = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < num_ops; i++) {
+        replay_op* op = &ops[i];
+        size_t size = op -> size > 0 ? op -> size : 1;
+        void* ptr;
+        switch (op -> op) {
+            case SF_TRACE_FREE:
+                if (blocks[op -> id] != NULL) {
+                    allocator -> release(blocks[op -> id]);
+                    blocks[op -> id] = NULL;
+                }
+                continue;
+            case SF_TRACE_CALLOC:
+                ptr = allocator -> allocate_zeroed(size);
+                break;
+            case SF_TRACE_REALLOC:
+                if (op -> old_id != NO_ID && blocks[op -> old_id] != NULL) {
+                    ptr = allocator -> reallocate(blocks[op -> old_id], size);
+                    if (ptr != NULL) {
+                        blocks[op -> old_id] = NULL;
+                    }
+                }
+                else {
+                    ptr = allocator -> allocate(size);
+                }
+                break;
+            case SF_TRACE_MEMALIGN:
+                ptr = allocator -> allocate_aligned(size, op -> align);
+                break;
+            default:
+                ptr = allocator -> allocate(size);
+                break;
+        }
+        if (ptr == NULL) {
+            failures++;
+        }
+        else {
+            *(char*)ptr = (char)i;          // Touch the block, as the traced program would have.
+        }
+        blocks[op -> id] = ptr;
+
+        if (i == peak_op) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed += seconds(&start, &end);
+            allocator -> sample(&footprint, &fragmentation);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed += seconds(&start, &end);
+
+    printf("%-8s %12.0f ops/s %12zu %12zu %8.2f %8.3f %8zu\n", allocator -> name, num_ops / elapsed, peak_live,
+           footprint, peak_live > 0 ? (double)footprint / peak_live : 0, fragmentation, failures);
+
+    for (uint32_t id = 0; id < num_ids; id++) {
+        if (blocks[id] != NULL) {
+            allocator -> release(blocks[id]);
+        }
+    }
+    munmap(blocks, ((size_t)num_ids + 1) * sizeof(void*));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace_file [sfmm|glibc|both]\n", argv[0]);
+        return 1;
+    }
+    const char* which = argc > 2 ? argv[2] : "both";
+    load(argv[1]);
+
+    printf("%zu ops, %u blocks\n", num_ops, num_ids);
+    printf("%-8s %16s %12s %12s %8s %8s %8s\n", "", "throughput", "peak live", "footprint", "ratio", "frag", "failed");
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(which, "both") == 0 || strcmp(which, allocators[i].name) == 0) {
+            replay(&allocators[i]);
+        }
+    }
+    return 0;
+}
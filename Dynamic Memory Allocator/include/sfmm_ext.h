@@ -0,0 +1,300 @@
+/**
+ * Functions of the allocator beyond the ones declared in sfmm.h.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+#include <stdint.h>
+#include "sfmm.h"
+
+/*
+ * Gives the memory of free blocks back to the OS. Every whole page inside a free block, other than the
+ * rows holding its header, links and footer, is released with madvise(MADV_DONTNEED). Free blocks keep
+ * their place in the heap and in the free lists, a released page is simply faulted in again on next use.
+ * If the heap can shrink, its end is lowered into the last free block as well.
+ *
+ * @param keep Number of bytes at the end of the last free block of the heap that stay resident, so that
+ * the next few allocations do not fault.
+ *
+ * @return Number of bytes released. Pages that were released before and not used since are not counted again.
+ *
+ * Free blocks of SF_TRIM_PAD + SF_TRIM_THRESHOLD bytes or more are also released automatically when they are
+ * freed, except for their last SF_TRIM_PAD bytes. Pages released that way are remembered and not released
+ * again until at least SF_TRIM_THRESHOLD bytes more can go.
+ */
+size_t sf_trim(size_t keep);
+
+/*
+ * Allocates count blocks of the same size in one call. Blocks are taken from the quick list of that size
+ * first, the rest are cut out of as few free blocks as possible.
+ *
+ * @param size The number of bytes requested for every block.
+ * @param count Number of blocks requested.
+ * @param ptrs Array of at least count pointers, receives the allocated blocks.
+ *
+ * @return Number of blocks allocated. If it is less than count, sf_errno is set to ENOMEM; the blocks that
+ * were allocated are in the first entries of ptrs and must still be freed. If size is 0, 0 is returned
+ * without setting sf_errno.
+ */
+size_t sf_malloc_batch(size_t size, size_t count, void **ptrs);
+
+/*
+ * Frees count blocks in one call. Blocks that lie next to each other in memory are coalesced together.
+ * Order of the entries in ptrs is not kept.
+ *
+ * If any pointer is invalid, or the same pointer appears twice, the function calls abort() to exit the program.
+ */
+void sf_free_batch(void **ptrs, size_t count);
+
+/*
+ * Allocates memory for an array of nmemb elements of size bytes each, with every byte set to 0.
+ * Huge blocks come from a new mapping, and parts of the heap that were never used since it grew are
+ * zero already; only the rest is cleared.
+ *
+ * @return Same as sf_malloc(nmemb * size). If nmemb * size does not fit in a size_t, NULL is returned and
+ * sf_errno is set to ENOMEM.
+ */
+void *sf_calloc(size_t nmemb, size_t size);
+
+/*
+ * Frees a block whose size is known to the caller. Instead of the full validation of sf_free(), the block's
+ * header is only checked against size, so this is cheaper.
+ *
+ * @param ptr Address of memory returned by sf_malloc, sf_realloc or sf_memalign.
+ * @param size The size that was requested for the block (for sf_realloc, the latest one).
+ *
+ * If ptr is NULL, or its header does not match size, the function calls abort() to exit the program.
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/*
+ * Free blocks are kept in SF_NUM_CLASSES size classes instead of the NUM_FREE_LISTS lists of sfmm.h. Every range
+ * of those lists, (M, 2M], (2M, 4M] and so on, is split into SF_CLASS_STEPS classes of equal width, never narrower
+ * than 16 bytes, and the last class holds all blocks larger than the others. Defaults cover the same sizes as
+ * sfmm.h, up to 256M, in 4 classes per range. Build with -DSF_CLASS_STEPS=<power of two> and -DSF_NUM_CLASSES=<n>
+ * (at most 64) to change them, the same for the allocator and the code calling sf_get_stats();
+ * -DSF_CLASS_STEPS=1 -DSF_NUM_CLASSES=10 gives exactly the lists of sfmm.h.
+ */
+#ifndef SF_CLASS_STEPS
+#define SF_CLASS_STEPS 4
+#endif
+#ifndef SF_NUM_CLASSES
+#define SF_NUM_CLASSES 32
+#endif
+
+/*
+ * Live statistics of the allocator. Byte counts include block headers.
+ */
+struct sf_stats {
+    size_t heap_bytes;                          // Size of the heap, from sf_mem_start() to sf_mem_end().
+    size_t mapped_bytes;                        // Size of all mappings of huge blocks.
+    size_t allocated_bytes;                     // Allocated blocks of the heap, plus mapped_bytes.
+    size_t peak_allocated_bytes;                // Highest allocated_bytes so far.
+    size_t quick_list_bytes;                    // Blocks waiting in quick lists.
+    size_t deferred_bytes;                      // Freed blocks waiting to be coalesced, see SF_DEFERRED_COALESCE.
+    size_t free_bytes;                          // Blocks in free lists, sum of free_list_bytes.
+    size_t free_list_bytes[SF_NUM_CLASSES];     // Blocks in the free list of each size class.
+    size_t largest_free_block;
+    double fragmentation;                       // 1 - largest_free_block / free_bytes, 0 with no free bytes.
+    size_t quick_list_hits;                     // Allocations served from a quick list.
+    size_t quick_list_misses;                   // Allocations of a quick list size that found its list empty.
+    size_t quick_list_flushes;                  // Times a full quick list was emptied into the free lists.
+    size_t coalesces;                           // Free blocks merged with a free neighbour.
+    size_t heap_grows;                          // Times the heap was extended.
+};
+
+/*
+ * Fills stats with the current statistics. Counters are kept up to date as the heap changes, so this takes
+ * constant time, except for largest_free_block: it is exact when the last size class has a block, and found
+ * in O(log n) then. Otherwise it is estimated from the size range of the highest non empty size class.
+ *
+ * With the thread cache, blocks cached by threads count as allocated, and allocations served from a thread's
+ * cache are not counted as quick list hits. While other threads allocate, numbers may be off by the blocks
+ * being moved at that moment.
+ */
+void sf_get_stats(struct sf_stats *stats);
+
+/*
+ * Allocator built with -DSF_TRACE ("make trace", "make preload_trace") appends a record to a trace file for every
+ * successful sf_malloc, sf_calloc, sf_realloc, sf_memalign and free. File is named by the SF_TRACE_FILE environment
+ * variable, "sfmm.trace" by default, and holds SF_TRACE_MAGIC followed by records. Threads buffer their records
+ * and write them in blocks, so records of different threads are not in order; bin/sfmm_replay sorts them by time.
+ * A block is identified by its address, which may be reused once the block is freed.
+ */
+#define SF_TRACE_MAGIC "SFTRACE1"
+
+enum sf_trace_op {
+    SF_TRACE_MALLOC = 1,
+    SF_TRACE_CALLOC,
+    SF_TRACE_REALLOC,
+    SF_TRACE_MEMALIGN,
+    SF_TRACE_FREE
+};
+
+typedef struct sf_trace_record {
+    uint64_t time;                  // CLOCK_MONOTONIC in nanoseconds: after an allocation, before a free or realloc.
+    uint64_t id;                    // Block returned by the call, or freed by it.
+    uint64_t arg;                   // SF_TRACE_REALLOC: block passed in. SF_TRACE_MEMALIGN: alignment.
+    uint64_t size : 56;             // Requested size in bytes, total size for calloc.
+    uint64_t op : 8;                // One of sf_trace_op.
+} sf_trace_record;
+
+/*
+ * Writes out the records every thread has buffered so far. Done at exit and when a thread ends anyway.
+ * Does nothing unless built with -DSF_TRACE.
+ */
+void sf_trace_flush();
+
+/*
+ * A slab hands out objects of a single size without any per object header. Objects are packed into
+ * page sized chunks taken from the heap, and a bitmap in each chunk keeps track of the free ones.
+ * A slab must not be used by several threads at the same time.
+ */
+typedef struct sf_slab sf_slab;
+
+/*
+ * Creates a slab for objects of obj_size bytes.
+ *
+ * @param obj_size Size of every object.
+ * @param align Alignment of every object, a power of two up to half a page. 0 means 16.
+ *
+ * @return The new slab. If obj_size is 0, align is invalid or an object would not fit in a chunk, NULL is
+ * returned and sf_errno is set to EINVAL. If the slab could not be allocated, NULL is returned and sf_errno
+ * is set to ENOMEM.
+ */
+sf_slab *sf_slab_create(size_t obj_size, size_t align);
+
+/*
+ * @return An object of the slab, or NULL with sf_errno set to ENOMEM if no chunk could be allocated.
+ */
+void *sf_slab_alloc(sf_slab *slab);
+
+/*
+ * Returns an object to its slab. Chunks left with no objects in use are given back to the heap, except for
+ * the last one.
+ *
+ * If obj was not handed out by this slab or is already free, the function calls abort() to exit the program.
+ */
+void sf_slab_free(sf_slab *slab, void *obj);
+
+/*
+ * Gives every chunk of the slab back to the heap, whether its objects are free or not, and frees the slab.
+ */
+void sf_slab_destroy(sf_slab *slab);
+
+/*
+ * An arena hands out memory from large chunks by bumping a pointer, and gives it all back at once.
+ * Memory from an arena is never freed on its own. An arena must not be used by several threads at the same time.
+ */
+typedef struct sf_arena sf_arena;
+
+/*
+ * Creates an empty arena. No chunk is allocated before the first sf_arena_alloc().
+ *
+ * @param chunk_size Number of bytes taken from the heap at a time, 0 for a page worth.
+ *
+ * @return The new arena. If chunk_size is too small to hold anything, NULL is returned and sf_errno is set
+ * to EINVAL. If the arena could not be allocated, NULL is returned and sf_errno is set to ENOMEM.
+ */
+sf_arena *sf_arena_create(size_t chunk_size);
+
+/*
+ * @return size bytes of memory aligned to 16 bytes, valid until the arena is reset or destroyed.
+ * If size is 0, NULL is returned without setting sf_errno. If a new chunk could not be allocated,
+ * NULL is returned and sf_errno is set to ENOMEM. Requests larger than a chunk get a chunk of their own.
+ */
+void *sf_arena_alloc(sf_arena *arena, size_t size);
+
+/*
+ * Releases everything allocated from the arena. All chunks but one go back to the heap, the remaining
+ * one serves the next allocations.
+ */
+void sf_arena_reset(sf_arena *arena);
+
+/*
+ * Gives every chunk of the arena back to the heap and frees the arena.
+ */
+void sf_arena_destroy(sf_arena *arena);
+
+/*
+ * A heap of its own: blocks, quick lists, free lists and locks that no other heap shares, in a range of addresses
+ * that only this heap uses. sf_malloc() and the other functions above work on the default heap, a NULL sf_heap_t.
+ * Blocks of a created heap never go through the thread cache and never get a mapping of their own, however large,
+ * so destroying the heap releases all of them at once.
+ */
+typedef struct sf_heap sf_heap_t;
+
+/*
+ * Creates an empty heap. Address space for the whole heap is reserved up front, pages are only used as it grows.
+ *
+ * @param size Largest size the heap may grow to, rounded up to whole pages. 0 means SF_HEAP_SIZE, 1 GB unless
+ * built with -DSF_HEAP_SIZE=<bytes>.
+ *
+ * @return The new heap. If its space could not be mapped, NULL is returned and sf_errno is set to ENOMEM.
+ */
+sf_heap_t *sf_heap_create(size_t size);
+
+/*
+ * Same as sf_malloc(), from the given heap.
+ */
+void *sf_heap_malloc(sf_heap_t *heap, size_t size);
+
+/*
+ * Same as sf_free(), for a block of the given heap. If ptr was not allocated from that heap, the function
+ * calls abort() to exit the program.
+ */
+void sf_heap_free(sf_heap_t *heap, void *ptr);
+
+/*
+ * Releases every block of a heap made by sf_heap_create(), allocated or not, and the heap itself.
+ * Pointers into the heap must not be used afterwards. A NULL heap is ignored.
+ * A heap of sf_heap_open() is written back to its file and unmapped instead; its blocks stay in the file for the
+ * next sf_heap_open(). Removing the file discards them.
+ */
+void sf_heap_destroy(sf_heap_t *heap);
+
+/*
+ * Persistent heaps: the heap, its lists included, lives in a file mapped at a fixed address, so a pointer stored
+ * in one block to another one is still right when a later process maps the file again. Nothing has to be
+ * rebuilt after a restart, a process finds its data through the heap's root pointers.
+ * A new file is mapped at SF_HEAP_BASE, build with -DSF_HEAP_BASE=<address> to move it; an existing file is mapped
+ * where it was made. A file only opens in a build with the same heap layout (the same SF_CLASS_STEPS,
+ * SF_NUM_CLASSES, SF_THREAD_CACHE, SF_LOCK_STRIPED and SF_DEFERRED_COALESCE) and only in one process at a time.
+ * The file is consistent once sf_heap_destroy() has returned; a file that was still open when its process died
+ * is refused.
+ */
+#define SF_HEAP_ROOTS 16
+
+/*
+ * Maps the heap kept in a file, creating the file and an empty heap in it if the file is empty or missing.
+ *
+ * @param size Largest size the heap may grow to, for a new file only. 0 means SF_HEAP_SIZE.
+ *
+ * @return The heap. On failure, NULL is returned and sf_errno is set: EINVAL if the file holds no heap of this
+ * build, EBUSY if another process has it open, EIO if it was not closed, ENOMEM if its address is taken,
+ * or the error of the failed system call.
+ */
+sf_heap_t *sf_heap_open(const char *path, size_t size);
+
+/*
+ * Huge pages: build with -DSF_HUGE_PAGES to have the preload heap and heaps of sf_heap_create() grow in 2 MB
+ * extents aligned for transparent huge pages, each advised with MADV_HUGEPAGE. Whether the kernel actually backs
+ * them with huge pages depends on /sys/kernel/mm/transparent_hugepage; this tells.
+ *
+ * @return Bytes of the mappings holding the given heap (NULL for the default heap) that are backed by huge pages,
+ * as /proc/self/smaps reports them. 0 if there are none, or if smaps cannot be read.
+ */
+size_t sf_huge_page_bytes(sf_heap_t *heap);
+
+/*
+ * Stores ptr, which should point into the heap, as root pointer index (0 to SF_HEAP_ROOTS - 1) of a created heap.
+ * An index out of range sets sf_errno to EINVAL and stores nothing.
+ */
+void sf_heap_set_root(sf_heap_t *heap, int index, void *ptr);
+
+/*
+ * @return Root pointer index of a created heap, NULL if it was never set. An index out of range returns NULL
+ * and sets sf_errno to EINVAL.
+ */
+void *sf_heap_get_root(sf_heap_t *heap, int index);
+
+#endif
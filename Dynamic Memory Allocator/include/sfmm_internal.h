@@ -0,0 +1,299 @@
+/**
+ * Helpers shared between the allocator's source files.
+ * Nothing in here is part of the public interface, that is in sfmm.h and sfmm_ext.h.
+ */
+#ifndef SFMM_INTERNAL_H
+#define SFMM_INTERNAL_H
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+/*
+ * Build with -DSF_THREAD_CACHE to make the allocator usable from several threads.
+ * Every list and boundary tag of a heap is then guarded by the heap's mutex, and
+ * small blocks of the default heap are cached per thread in front of it (see sftcache.c).
+ *
+ * Build with -DSF_LOCK_STRIPED to replace that mutex with one lock per quick list and one lock
+ * per free list. Taking a block out of a list and splitting it only needs that list's lock (plus
+ * the lock of the list receiving the splinter), so allocations from different lists run in parallel.
+ * Coalescing and growing the heap rewrite neighbouring blocks which may sit in any list, so they
+ * hold the heap's tags_lock exclusively, while list allocations hold it shared.
+ * Lock order: quick list lock, then tags_lock, then free list locks from higher to lower index.
+ * Every heap has locks of its own, no thread ever holds locks of two heaps.
+ */
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+#include <pthread.h>
+#endif
+
+#if defined(SF_THREAD_CACHE) && !defined(SF_LOCK_STRIPED)
+#define SF_HEAP_LOCK(heap)   pthread_mutex_lock(&(heap) -> mutex)
+#define SF_HEAP_UNLOCK(heap) pthread_mutex_unlock(&(heap) -> mutex)
+#else
+#define SF_HEAP_LOCK(heap)   ((void)(heap))
+#define SF_HEAP_UNLOCK(heap) ((void)(heap))
+#endif
+
+#ifdef SF_LOCK_STRIPED
+#define SF_TAGS_SHARED_LOCK(heap)           pthread_rwlock_rdlock(&(heap) -> tags_lock)
+#define SF_TAGS_EXCLUSIVE_LOCK(heap)        pthread_rwlock_wrlock(&(heap) -> tags_lock)
+#define SF_TAGS_UNLOCK(heap)                pthread_rwlock_unlock(&(heap) -> tags_lock)
+#define SF_QUICK_LIST_LOCK(heap, index)     pthread_mutex_lock(&(heap) -> quick_list_locks[index])
+#define SF_QUICK_LIST_UNLOCK(heap, index)   pthread_mutex_unlock(&(heap) -> quick_list_locks[index])
+#define SF_FREE_LIST_LOCK(heap, index)      pthread_mutex_lock(&(heap) -> free_list_locks[index])
+#define SF_FREE_LIST_UNLOCK(heap, index)    pthread_mutex_unlock(&(heap) -> free_list_locks[index])
+#else
+#define SF_TAGS_SHARED_LOCK(heap)           ((void)(heap))
+#define SF_TAGS_EXCLUSIVE_LOCK(heap)        ((void)(heap))
+#define SF_TAGS_UNLOCK(heap)                ((void)(heap))
+#define SF_QUICK_LIST_LOCK(heap, index)     ((void)(heap), (void)(index))
+#define SF_QUICK_LIST_UNLOCK(heap, index)   ((void)(heap), (void)(index))
+#define SF_FREE_LIST_LOCK(heap, index)      ((void)(heap), (void)(index))
+#define SF_FREE_LIST_UNLOCK(heap, index)    ((void)(heap), (void)(index))
+#endif
+
+/*
+ * One free list per size class (see SF_NUM_CLASSES in sfmm_ext.h), each headed by a dummy block as described in
+ * sfmm.h. When the classes are the lists of sfmm.h, the default heap uses its sf_free_list_heads, otherwise an
+ * array of our own.
+ * CLASS_LIMIT(i) is the largest block size of class i, a constant expression; free_list_index() goes the other way.
+ * Sizes up to 2 * SF_CLASS_STEPS rows of 16 bytes get a class each, from there on every doubling gets
+ * SF_CLASS_STEPS classes. The last class has no limit, its CLASS_LIMIT() is never used. Shift is capped so that
+ * every CLASS_LIMIT() fits a size_t, classes above 2^60 bytes could never hold a block anyway.
+ */
+#if SF_CLASS_STEPS == 1 && SF_NUM_CLASSES == NUM_FREE_LISTS
+#define sf_class_heads sf_free_list_heads
+#else
+extern struct sf_block sf_class_heads[SF_NUM_CLASSES];
+#endif
+
+#define CLASS_LIMIT(i) ((i) < 2 * SF_CLASS_STEPS - 1 ? (size_t)16 * ((i) + 2) : \
+    (size_t)16 * (SF_CLASS_STEPS + ((i) + 1) % SF_CLASS_STEPS + 1) * ((size_t)1 << CLASS_SHIFT(i)) / 2)
+#define CLASS_SHIFT(i) (((i) + 1) / SF_CLASS_STEPS < 56 ? ((i) + 1) / SF_CLASS_STEPS : 56)
+
+/*
+ * Blocks in the last size class are larger than any other class, which leaves them plenty of room for
+ * the forward pointers of a skip list besides the list links. That skip list orders the last class by (size, address)
+ * and lets check_free_lists() pick the best fit in O(log n) instead of scanning the whole list first-fit.
+ * Blocks stay in the regular circular list as well, so everything walking sf_class_heads still works.
+ */
+#define LARGE_INDEX_LEVELS 16
+
+typedef struct sf_large_block {
+    sf_footer prev_footer;
+    sf_header header;
+    struct sf_block *next;                                  // Same as body.links of a sf_block.
+    struct sf_block *prev;
+    long levels;                                            // Number of forward pointers this block uses.
+    struct sf_large_block *forward[LARGE_INDEX_LEVELS];     // Next block on each level of the skip list.
+} sf_large_block;
+
+/*
+ * Blocks of SF_MMAP_THRESHOLD bytes or more are mapped on their own (see sfmmap.c), their header has
+ * MMAPPED_BLOCK set. Build with -DSF_MMAP_THRESHOLD=<bytes> to move the threshold.
+ */
+#ifndef SF_MMAP_THRESHOLD
+#define SF_MMAP_THRESHOLD (8 * PAGE_SZ)
+#endif
+#define MMAPPED_BLOCK 0x1
+#define IS_MMAPPED(header) (((*(header))^MAGIC) & MMAPPED_BLOCK)
+
+/*
+ * Free blocks of SF_TRIM_PAD + SF_TRIM_THRESHOLD bytes or more release their pages as soon as they are freed,
+ * except for the last SF_TRIM_PAD bytes, and only once at least SF_TRIM_THRESHOLD bytes that were not released
+ * before would go (see trim_free_block() in sftrim.c). Build with -DSF_TRIM_THRESHOLD=0 to only release pages
+ * on sf_trim().
+ */
+#ifndef SF_TRIM_THRESHOLD
+#define SF_TRIM_THRESHOLD (8 * PAGE_SZ)
+#endif
+#ifndef SF_TRIM_PAD
+#define SF_TRIM_PAD (8 * PAGE_SZ)
+#endif
+
+/*
+ * Released pages are remembered in up to RELEASED_RANGES ranges, so that trimming does not release and count
+ * them again. Each range lies inside one free block; claim_clean() in sfmm.c takes allocated bytes out of it.
+ */
+#define RELEASED_RANGES 4
+
+typedef struct sf_range {
+    char *start;
+    char *end;
+} sf_range;
+
+/*
+ * Counters behind sf_get_stats(), updated where blocks move between lists. Threads may update them under
+ * different locks, so threaded builds use atomic operations. Free and quick list bytes include headers.
+ */
+typedef struct sf_counters {
+    size_t peak_allocated_bytes;
+    size_t mapped_bytes;
+    size_t quick_list_bytes;
+    size_t deferred_bytes;
+    size_t free_list_bytes[SF_NUM_CLASSES];
+    size_t quick_list_hits;
+    size_t quick_list_misses;
+    size_t quick_list_flushes;
+    size_t coalesces;
+    size_t heap_grows;
+} sf_counters;
+
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+#define STAT_ADD(heap, counter, n) __atomic_fetch_add(&(heap) -> counters.counter, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(heap, counter, n) __atomic_fetch_sub(&(heap) -> counters.counter, (n), __ATOMIC_RELAXED)
+#define STAT_READ(heap, counter)   __atomic_load_n(&(heap) -> counters.counter, __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(heap, counter, n) ((heap) -> counters.counter += (n))
+#define STAT_SUB(heap, counter, n) ((heap) -> counters.counter -= (n))
+#define STAT_READ(heap, counter)   ((heap) -> counters.counter)
+#endif
+
+/*
+ * Quick lists do not all hold QUICK_LIST_MAX blocks: each list's capacity follows its hit rate (see
+ * adapt_quick_list() in sfmm.c). A list's state is guarded by that list's lock.
+ */
+struct quick_list_state {
+    int capacity;               // Blocks the list may hold, it is flushed when one more arrives.
+    int requests;               // Allocations that looked at the list this epoch.
+    int hits;                   // Those of them the list served.
+    int flushes;                // Times the list overflowed this epoch.
+    int low_water;              // Fewest blocks the list held this epoch.
+};
+
+/*
+ * Everything a heap is made of, besides its blocks. sf_malloc() and the rest of sfmm.h work on sf_default_heap,
+ * which takes its pages from sf_mem_grow() and keeps the quick lists of sfmm.h. A heap made by sf_heap_create()
+ * sits at the start of its own mapping and takes its pages from the rest of it (see sfheap.c); its lists are the
+ * arrays at the end of the struct. A heap of sf_heap_open() is the same, with a file behind the mapping: every
+ * pointer in here stays valid as long as the file is mapped at the address it was made at.
+ */
+struct sf_heap {
+    unsigned long file_magic;                               // HEAP_FILE_MAGIC in a file-backed heap.
+    size_t file_layout;                                     // sizeof(struct sf_heap) of the build that made the file.
+    unsigned int file_class_steps;                          // SF_CLASS_STEPS of that build.
+    unsigned int file_num_classes;                          // SF_NUM_CLASSES of that build.
+    unsigned long file_features;                            // HEAP_FILE_FEATURES of that build, see sfheap.c.
+    char *mapping_start;                                    // Mapping of a created heap, struct included.
+    size_t mapping_size;
+    int file_fd;                                            // -1 unless file-backed, holds the file's lock.
+    int file_open;                                          // Set in the file while a process has it mapped.
+    uint64_t tag_magic;                                     // MAGIC the file's boundary tags are stored with.
+    void *roots[SF_HEAP_ROOTS];                             // See sf_heap_set_root().
+    __typeof__(sf_quick_lists[0]) *quick_lists;             // NUM_QUICK_LISTS quick lists.
+    sf_block *class_heads;                                  // SF_NUM_CLASSES free list dummies.
+    unsigned long free_list_bitmap;                         // Bit i is set while class_heads[i] has at least one block.
+    sf_large_block large_index_head;                        // Skip list head over the last free list.
+    unsigned int large_index_seed;                          // State of the generator picking skip list levels.
+    struct quick_list_state quick_list_states[NUM_QUICK_LISTS];
+    long quick_list_budget_used;                            // Sum of capacity * block size over all quick lists.
+    int first_page_flag;                                    // Set until the first page is added.
+    char *clean_start;                                      // Zero bytes, see add_clean_pages() in sfmm.c.
+    char *clean_end;
+    sf_range released[RELEASED_RANGES];                     // Released pages, see trim_free_block() in sftrim.c.
+    char *mem_start;                                        // Pages of a created heap; the default heap asks sfutil.
+    char *mem_end;
+    char *mem_limit;                                        // End of the mapping, NULL for the default heap.
+    sf_counters counters;
+#ifdef SF_DEFERRED_COALESCE
+    sf_block *pending_first;                                // See sfdefer.c.
+    size_t pending_bytes;
+#endif
+#if defined(SF_THREAD_CACHE) && !defined(SF_LOCK_STRIPED)
+    pthread_mutex_t mutex;                                  // Guards every list and boundary tag of the heap.
+#endif
+#ifdef SF_LOCK_STRIPED
+    pthread_rwlock_t tags_lock;                             // Shared while allocating out of a list, exclusive while coalescing.
+    pthread_mutex_t quick_list_locks[NUM_QUICK_LISTS];
+    pthread_mutex_t free_list_locks[SF_NUM_CLASSES];
+#ifdef SF_DEFERRED_COALESCE
+    pthread_mutex_t defer_lock;                             // Guards the pending list, taken before tags_lock.
+#endif
+#endif
+    __typeof__(sf_quick_lists[0]) own_quick_lists[NUM_QUICK_LISTS];     // Unused by the default heap.
+    sf_block own_class_heads[SF_NUM_CLASSES];
+};
+
+extern sf_heap_t sf_default_heap;
+
+/*
+ * Build with -DSF_TRACE to record every allocation and free (see sftrace.c). Files defining the public functions
+ * define SF_TRACE_INNER before including this header: their functions are then compiled as sf_*_untraced, and so
+ * are the calls among them, while sftrace.c defines the public names as wrappers that record the call.
+ */
+#if defined(SF_TRACE) && defined(SF_TRACE_INNER)
+#define sf_malloc       sf_malloc_untraced
+#define sf_calloc       sf_calloc_untraced
+#define sf_realloc      sf_realloc_untraced
+#define sf_memalign     sf_memalign_untraced
+#define sf_free         sf_free_untraced
+#define sf_free_sized   sf_free_sized_untraced
+#define sf_malloc_batch sf_malloc_batch_untraced
+#define sf_free_batch   sf_free_batch_untraced
+
+// sfmm.h was read before the names changed.
+void *sf_malloc(size_t size);
+void *sf_realloc(void *ptr, size_t size);
+void *sf_memalign(size_t size, size_t align);
+void sf_free(void *ptr);
+#endif
+
+/*
+ * Build with -DSF_MEM_GROW_ZEROED when sf_mem_grow() hands out pages nobody has written yet, as the preload
+ * heap does. sf_calloc() then skips clearing the bytes of a block that were never used since. lib/sfutil.o
+ * takes its heap from malloc(), so without the flag only huge blocks are known to be zero.
+ */
+
+/*
+ * Build with -DSF_HUGE_PAGES to back the preload heap and created heaps with transparent huge pages. Their space
+ * is then aligned to SF_HUGE_EXTENT, and each extent is marked MADV_HUGEPAGE as the heap reaches it. mem_grow()
+ * still adds one page at a time, inside the extent. lib/sfutil.o takes its heap from malloc(), the flag does not
+ * change that heap.
+ */
+#define SF_HUGE_EXTENT ((size_t)2 << 20)
+
+/* sfmm.c: caller must hold the heap lock, unless stated otherwise. */
+void setup_heap();                  // Sets up the default heap, needs no lock.
+void setup_quick_and_free_lists(sf_heap_t* heap);   // Only while no other thread can use the heap.
+void setup_locks(sf_heap_t* heap);                  // Same.
+sf_block* malloc_block(sf_heap_t* heap, size_t size);
+void free_block(sf_heap_t* heap, sf_header* block_header);
+void free_block_run(sf_heap_t* heap, sf_header* block_header, size_t size);
+int belongs_to_quick_list(double size);
+size_t adjusted_block_size(size_t size);
+int is_valid_header(sf_heap_t* heap, void* ptr);
+int is_valid_block(sf_heap_t* heap, void* ptr);     // Does not read neighbouring blocks, needs no lock.
+size_t largest_free_block(sf_heap_t* heap);         // Takes the locks it needs.
+int mem_shrink(sf_heap_t* heap, size_t pages);      // With striped locks, caller must hold the tags lock exclusively.
+void* heap_start(sf_heap_t* heap);                  // Bounds of the heap's pages, need no lock.
+void* heap_end(sf_heap_t* heap);
+
+/* sfheap.c: needs no lock. */
+void huge_extent_advise(char* extent, char* limit);
+
+/* sfmmap.c: called without the heap lock. Huge blocks only belong to the default heap. */
+sf_block* mmap_block(size_t size);
+void munmap_block(sf_header* block_header);
+sf_block* mremap_block(sf_header* block_header, size_t size);
+int is_valid_mmapped_block(sf_header* block_header);
+
+/* sfstats.c: needs no lock. */
+void stats_note_peak(sf_heap_t* heap);
+
+/* sftrim.c: with striped locks, caller must hold the tags lock exclusively. */
+void trim_free_block(sf_heap_t* heap, sf_header* block_header);
+
+/*
+ * Build with -DSF_DEFERRED_COALESCE to park freed large blocks and coalesce them later in batches (see sfdefer.c).
+ * Lock order with striped locks: quick list lock, then the heap's defer_lock, then its tags_lock.
+ */
+
+/* sfdefer.c: caller must hold the heap lock, and not the tags lock. */
+void defer_free(sf_heap_t* heap, sf_header* block_header, size_t block_size);
+sf_block* defer_take(sf_heap_t* heap, size_t size);
+int defer_sweep(sf_heap_t* heap);
+
+/* sftcache.c: called without the heap lock. Caches blocks of the default heap. */
+sf_block* tcache_malloc(size_t size);
+int tcache_free(void* ptr);
+int tcache_free_block(sf_header* block_header, size_t block_size);
+
+#endif
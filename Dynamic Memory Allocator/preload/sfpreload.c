@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
+
+/*
+ * LD_PRELOAD shim: exports the standard allocation functions on top of sf_malloc and friends, so that an
+ * unmodified program runs on this allocator:
+ *
+ *   LD_PRELOAD=bin/libsfmm.so ./program
+ *
+ * Library is built with thread caches and striped locks (see "make preload"). Nothing on the allocation path
+ * calls malloc itself: the heap comes from mmap (sfpreload_mem.c), thread locals use the initial-exec model,
+ * and the thread cache marks itself registered before pthread_setspecific() could allocate. The one place
+ * that could recurse is fork(), handled by taking every allocator lock around it.
+ */
+
+/*
+ * Errors are reported through errno here, sf_errno is only for sfmm's own interface.
+ */
+static void* report(void* ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    return report(sf_malloc(size != 0 ? size : 1));    // malloc(0) must give a unique pointer.
+}
+
+void free(void* ptr) {
+    if (ptr != NULL) {
+        sf_free(ptr);
+    }
+}
+
+void* calloc(size_t count, size_t size) {
+    if (count == 0 || size == 0) {      // Like malloc(0), must give a unique pointer.
+        count = 1;
+        size = 1;
+    }
+    return report(sf_calloc(count, size));
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        sf_free(ptr);
+        return NULL;
+    }
+    return report(sf_realloc(ptr, size));
+}
+
+void* reallocarray(void* ptr, size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+void* memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align <= 16) {                  // Every block is 16 byte aligned already.
+        return malloc(size);
+    }
+    return report(sf_memalign(size != 0 ? size : 1, align));
+}
+
+int posix_memalign(void** result, size_t align, size_t size) {
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = memalign(align, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *result = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(PAGE_SZ, size);
+}
+
+void* pvalloc(size_t size) {
+    if (size > (size_t)-1 - (PAGE_SZ - 1)) {       // Rounding up to a page would wrap around.
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(PAGE_SZ, (size + PAGE_SZ - 1) & ~(PAGE_SZ - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    sf_header* block_header = (sf_header*)ptr - 1;
+    if (IS_MMAPPED(block_header)) {
+        return ((*block_header^MAGIC) & ~0x7) - 16;         // Mapping minus the unused row and the header.
+    }
+    return ((*block_header^MAGIC) & ~0x7) - 8;
+}
+
+/*
+ * fork() only copies the calling thread. If another thread held an allocator lock at that moment, the child
+ * would find it locked forever, so every lock is taken before forking and released on both sides after.
+ * Locks are taken in the allocator's lock order. Child is a new thread id, which cannot unlock a rwlock
+ * taken by the parent, so the child initialises its locks again instead.
+ */
+static void fork_prepare() {
+    sf_heap_t* heap = &sf_default_heap;
+    setup_heap();
+#ifdef SF_LOCK_STRIPED
+    for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+        SF_QUICK_LIST_LOCK(heap, index);
+    }
+#ifdef SF_DEFERRED_COALESCE
+    pthread_mutex_lock(&heap -> defer_lock);
+#endif
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    for (int index = SF_NUM_CLASSES - 1; index >= 0; index--) {
+        SF_FREE_LIST_LOCK(heap, index);
+    }
+#endif
+    SF_HEAP_LOCK(heap);
+}
+
+static void fork_parent() {
+    sf_heap_t* heap = &sf_default_heap;
+    SF_HEAP_UNLOCK(heap);
+#ifdef SF_LOCK_STRIPED
+    for (int index = 0; index < SF_NUM_CLASSES; index++) {
+        SF_FREE_LIST_UNLOCK(heap, index);
+    }
+    SF_TAGS_UNLOCK(heap);
+#ifdef SF_DEFERRED_COALESCE
+    pthread_mutex_unlock(&heap -> defer_lock);
+#endif
+    for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+        SF_QUICK_LIST_UNLOCK(heap, index);
+    }
+#endif
+}
+
+static void fork_child() {
+    setup_locks(&sf_default_heap);
+}
+
+__attribute__((constructor))
+static void preload_init() {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
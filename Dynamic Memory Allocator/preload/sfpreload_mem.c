@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+#include "errno.h"
+
+/*
+ * Heap of the preload library. lib/sfutil.o cannot be used there: it sets its heap up with malloc(), which
+ * would be our own malloc, and it stops at 16 pages. This file provides the same sf_mem_* interface over one
+ * large reservation made with mmap(). Pages are handed out one at a time like sfutil does, but are made
+ * accessible in steps of PRELOAD_COMMIT_STEP bytes to keep mprotect() calls rare. With SF_HUGE_PAGES, a step
+ * is one huge page: the reservation is aligned to it and every step is advised MADV_HUGEPAGE. Unlike sfutil,
+ * the heap can also shrink: sf_mem_shrink() lets sf_trim() lower its end.
+ * sf_mem_grow() is only called with the heap locked, so it needs no lock of its own.
+ */
+
+#ifndef SF_PRELOAD_HEAP_SIZE
+#define SF_PRELOAD_HEAP_SIZE ((size_t)1 << 36)     // Address space reserved for the heap, not memory used.
+#endif
+#ifdef SF_HUGE_PAGES
+#define PRELOAD_COMMIT_STEP ((size_t)2 << 20)
+#else
+#define PRELOAD_COMMIT_STEP ((size_t)1 << 20)
+#endif
+
+static char* heap_start;            // NULL if the reservation failed.
+static char* heap_end;              // Read without the heap lock, so accessed atomically.
+static char* heap_committed;        // End of the part of the reservation that is readable and writable.
+static uint64_t heap_magic;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static void heap_init() {
+    size_t slack = 0;
+#ifdef SF_HUGE_PAGES
+    slack = PRELOAD_COMMIT_STEP;        // Room to align the heap to a huge page.
+#endif
+    char* reservation = mmap(NULL, SF_PRELOAD_HEAP_SIZE + slack, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#ifdef SF_HUGE_PAGES
+    if (reservation != MAP_FAILED) {
+        char* aligned = (char*)(((size_t)reservation + slack - 1) & ~(slack - 1));
+        if (aligned > reservation) {
+            munmap(reservation, aligned - reservation);
+        }
+        munmap(aligned + SF_PRELOAD_HEAP_SIZE, reservation + slack - aligned);
+        reservation = aligned;
+    }
+#endif
+    if (reservation != MAP_FAILED) {
+        heap_start = reservation;
+        heap_committed = reservation;
+        __atomic_store_n(&heap_end, heap_start, __ATOMIC_RELEASE);
+    }
+
+    // Any value works for obfuscation, take one that differs from run to run.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    heap_magic = ((uint64_t)now.tv_nsec << 32) ^ (uint64_t)now.tv_sec ^ (uint64_t)(size_t)&now;
+}
+
+void *sf_mem_start() {
+    pthread_once(&heap_once, heap_init);
+    return heap_start;
+}
+
+void *sf_mem_end() {
+    pthread_once(&heap_once, heap_init);
+    return __atomic_load_n(&heap_end, __ATOMIC_ACQUIRE);
+}
+
+void *sf_mem_grow() {
+    pthread_once(&heap_once, heap_init);
+    char* page = heap_end;
+    if (heap_start == NULL || page + PAGE_SZ > heap_start + SF_PRELOAD_HEAP_SIZE) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    if (page + PAGE_SZ > heap_committed) {
+        size_t step = PRELOAD_COMMIT_STEP;
+        if (heap_committed + step > heap_start + SF_PRELOAD_HEAP_SIZE) {
+            step = heap_start + SF_PRELOAD_HEAP_SIZE - heap_committed;
+        }
+        if (mprotect(heap_committed, step, PROT_READ | PROT_WRITE) != 0) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+#ifdef SF_HUGE_PAGES
+        madvise(heap_committed, step, MADV_HUGEPAGE);
+#endif
+        heap_committed += step;
+    }
+    __atomic_store_n(&heap_end, page + PAGE_SZ, __ATOMIC_RELEASE);
+    return page;
+}
+
+/*
+ * Lowers the end of the heap by `pages` pages, for sf_trim() (see mem_shrink() in sfmm.c). Their memory goes back
+ * with madvise(MADV_DONTNEED), so they read as zeros when sf_mem_grow() hands them out again, like fresh pages.
+ * Called with the heap locked, like sf_mem_grow().
+ *
+ * @return 0, or -1 if the heap has fewer pages than that.
+ */
+int sf_mem_shrink(size_t pages) {
+    pthread_once(&heap_once, heap_init);
+    char* end = heap_end;
+    if (heap_start == NULL || pages > (size_t)(end - heap_start) / PAGE_SZ) {
+        return -1;
+    }
+    char* new_end = end - pages * PAGE_SZ;
+    if (madvise(new_end, end - new_end, MADV_DONTNEED) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&heap_end, new_end, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint64_t sf_magic() {
+    pthread_once(&heap_once, heap_init);
+    return heap_magic;
+}
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Arenas: an arena takes chunks from the heap and hands out their memory by bumping a pointer. Nothing
+ * allocated from an arena is freed on its own; sf_arena_reset() gives all chunks but the first back to the
+ * heap at once, and the first one is reused from its start. Chunks are chained through a small header:
+ *
+ *   +------------+---------+------------------------------+
+ *   | next chunk | end     | allocations ...  -> | unused |
+ *   +------------+---------+------------------------------+
+ *                                                ^ arena -> next
+ *
+ * An arena must not be used by several threads at the same time.
+ */
+
+#define ARENA_DEFAULT_CHUNK (PAGE_SZ - 16)     // Payload of a block that fills a page exactly.
+
+typedef struct sf_arena_chunk {
+    struct sf_arena_chunk* next;        // Chunk allocated before this one, NULL for the first chunk.
+    char* end;                          // First byte after this chunk.
+    char data[] __attribute__((aligned(16)));
+} sf_arena_chunk;
+
+struct sf_arena {
+    size_t chunk_size;                  // Size of a regular chunk, header included.
+    sf_arena_chunk* chunks;             // Most recent chunk, allocations come from it.
+    char* next;                         // Next free byte in the most recent chunk.
+};
+
+/*
+ * This method takes a new chunk large enough for `size` bytes from the heap and makes it the current chunk.
+ *
+ * @return 1 on success, 0 if the heap is out of memory.
+ */
+static int arena_grow(sf_arena* arena, size_t size) {
+    size_t chunk_size = arena -> chunk_size;
+    if (sizeof(sf_arena_chunk) + size > chunk_size) {     // Allocations too big for a chunk get one of their own.
+        chunk_size = sizeof(sf_arena_chunk) + size;
+    }
+
+    sf_arena_chunk* chunk = sf_malloc(chunk_size);
+    if (chunk == NULL) {
+        return 0;
+    }
+    chunk -> next = arena -> chunks;
+    chunk -> end = (char*)chunk + chunk_size;
+    arena -> chunks = chunk;
+    arena -> next = chunk -> data;
+    return 1;
+}
+
+sf_arena* sf_arena_create(size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = ARENA_DEFAULT_CHUNK;
+    }
+    if (chunk_size <= sizeof(sf_arena_chunk)) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    sf_arena* arena = sf_malloc(sizeof(sf_arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena -> chunk_size = chunk_size;
+    arena -> chunks = NULL;
+    arena -> next = NULL;
+    return arena;
+}
+
+void* sf_arena_alloc(sf_arena* arena, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    size = (size + 15) & ~(size_t)15;               // Keep every allocation 16 byte aligned.
+
+    if (arena -> chunks == NULL || (size_t)(arena -> chunks -> end - arena -> next) < size) {
+        if (!arena_grow(arena, size)) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+    }
+    void* allocation = arena -> next;
+    arena -> next += size;
+    return allocation;
+}
+
+void sf_arena_reset(sf_arena* arena) {
+    if (arena -> chunks == NULL) {
+        return;
+    }
+
+    // Every chunk but the first one goes back to the heap, the first one is kept for the next round.
+    sf_arena_chunk* chunk = arena -> chunks;
+    while (chunk -> next != NULL) {
+        sf_arena_chunk* next = chunk -> next;
+        sf_free(chunk);
+        chunk = next;
+    }
+    arena -> chunks = chunk;
+    arena -> next = chunk -> data;
+}
+
+void sf_arena_destroy(sf_arena* arena) {
+    sf_arena_chunk* chunk = arena -> chunks;
+    while (chunk != NULL) {
+        sf_arena_chunk* next = chunk -> next;
+        sf_free(chunk);
+        chunk = next;
+    }
+    sf_free(arena);
+}
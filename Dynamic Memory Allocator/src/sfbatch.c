@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#define SF_TRACE_INNER          // Public functions are wrapped by sftrace.c in trace builds.
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Batches: many blocks of one size are allocated, or many blocks freed, under a single heap lock.
+ * Allocation first empties the quick list of that size, then takes one block big enough for the rest and
+ * cuts it into pieces. Freeing sorts the large blocks by address, so that blocks lying next to each other
+ * are merged and coalesced as one block instead of one after the other.
+ */
+
+/*
+ * This method takes up to `count` blocks of given size off their quick list.
+ *
+ * @return number of blocks stored to ptrs.
+ */
+static size_t take_quick_list_run(sf_heap_t* heap, size_t size, size_t count, void** ptrs) {
+    int list_location = (size-32)/16;
+    size_t taken = 0;
+
+    SF_QUICK_LIST_LOCK(heap, list_location);
+    while (taken < count && heap -> quick_lists[list_location].length > 0) {
+        sf_block* block = heap -> quick_lists[list_location].first;
+        heap -> quick_lists[list_location].first = block -> body.links.next;
+        heap -> quick_lists[list_location].length--;
+        ptrs[taken++] = block -> body.payload;
+    }
+    STAT_ADD(heap, quick_list_hits, taken);
+    STAT_SUB(heap, quick_list_bytes, taken * size);
+    SF_QUICK_LIST_UNLOCK(heap, list_location);
+    return taken;
+}
+
+/*
+ * This method cuts an allocated block into `count` allocated blocks of given size. Last one also gets what
+ * the block had on top of count * size, which is less than a splinter.
+ */
+static void split_run(sf_block* block, size_t size, size_t count, void** ptrs) {
+    sf_header* block_header = &block -> header;
+    size_t run_size = (*block_header^MAGIC) & ~0x6;
+    size_t prev_allocated = (*block_header^MAGIC) & PREV_BLOCK_ALLOCATED;    // Only the first piece keeps it.
+
+    for (size_t i = 0; i < count; i++) {
+        size_t piece_size = (i == count - 1) ? run_size - (count - 1) * size : size;
+        *block_header = (piece_size | THIS_BLOCK_ALLOCATED | prev_allocated)^MAGIC;
+        ptrs[i] = block_header + 1;
+        block_header += piece_size/8;
+        prev_allocated = PREV_BLOCK_ALLOCATED;
+    }
+}
+
+size_t sf_malloc_batch(size_t size, size_t count, void** ptrs) {
+    sf_heap_t* heap = &sf_default_heap;
+    if (size == 0) {
+        return 0;
+    }
+    size_t block_size = adjusted_block_size(size);
+    if (block_size == 0) {
+        sf_errno = ENOMEM;
+        return 0;
+    }
+    size_t filled = 0;
+
+    // Huge blocks have a mapping each, there is nothing to share between them.
+    if (block_size >= SF_MMAP_THRESHOLD) {
+        while (filled < count && (ptrs[filled] = sf_malloc(size)) != NULL) {
+            filled++;
+        }
+        return filled;
+    }
+
+    setup_heap();
+    SF_HEAP_LOCK(heap);
+    if (belongs_to_quick_list(block_size)) {
+        filled = take_quick_list_run(heap, block_size, count, ptrs);
+        stats_note_peak(heap);
+    }
+
+    // Rest comes in runs: one block of run * block_size bytes, cut into pieces. If no such block can be had,
+    // try again with half the run.
+    size_t run = count - filled;
+    while (filled < count) {
+        if (run > count - filled) {
+            run = count - filled;
+        }
+        sf_block* block = NULL;
+        if (run <= (size_t)-1 / block_size) {
+            block = malloc_block(heap, run * block_size);
+        }
+        if (block == NULL) {
+            if (run == 1) {
+                break;
+            }
+            run /= 2;
+            continue;
+        }
+        SF_TAGS_EXCLUSIVE_LOCK(heap);       // Splitting a free block below may set a bit of the first header.
+        split_run(block, block_size, run, ptrs + filled);
+        SF_TAGS_UNLOCK(heap);
+        filled += run;
+    }
+    SF_HEAP_UNLOCK(heap);
+
+    if (filled < count) {
+        sf_errno = ENOMEM;
+    }
+    return filled;
+}
+
+static int compare_addresses(const void* a, const void* b) {
+    size_t first = (size_t)*(void* const*)a;
+    size_t second = (size_t)*(void* const*)b;
+    return (first > second) - (first < second);
+}
+
+void sf_free_batch(void** ptrs, size_t count) {
+    sf_heap_t* heap = &sf_default_heap;
+    size_t large_count = 0;     // Large blocks are moved to the front of ptrs, to be freed together.
+
+    for (size_t i = 0; i < count; i++) {
+        void* pp = ptrs[i];
+        sf_header* block_header = (sf_header*)pp - 1;
+
+        if (is_valid_block(heap, pp) && IS_MMAPPED(block_header)) {
+            munmap_block(block_header);
+            continue;
+        }
+#ifdef SF_THREAD_CACHE
+        if (tcache_free(pp)) {
+            continue;
+        }
+#endif
+        SF_HEAP_LOCK(heap);
+        if (!is_valid_header(heap, pp)) {
+            abort();
+        }
+        if (belongs_to_quick_list((*block_header^MAGIC) & ~0x6)) {
+            free_block(heap, block_header);
+        }
+        else {
+            ptrs[large_count++] = pp;
+        }
+        SF_HEAP_UNLOCK(heap);
+    }
+    if (large_count == 0) {
+        return;
+    }
+
+    qsort(ptrs, large_count, sizeof(void*), compare_addresses);
+    for (size_t i = 1; i < large_count; i++) {
+        if (ptrs[i] == ptrs[i - 1]) {       // Same block twice, second free would be a double free.
+            abort();
+        }
+    }
+
+    // Blocks next to each other in memory are adjacent in ptrs now, free each such run as one block.
+    SF_HEAP_LOCK(heap);
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    size_t i = 0;
+    while (i < large_count) {
+        sf_header* run_header = (sf_header*)ptrs[i] - 1;
+        size_t run_size = (*run_header^MAGIC) & ~0x6;
+        for (i++; i < large_count && (sf_header*)ptrs[i] - 1 == run_header + run_size/8; i++) {
+            run_size += (*((sf_header*)ptrs[i] - 1)^MAGIC) & ~0x6;
+        }
+        free_block_run(heap, run_header, run_size);
+    }
+    SF_TAGS_UNLOCK(heap);
+    SF_HEAP_UNLOCK(heap);
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "errno.h"
+
+#ifdef SF_DEFERRED_COALESCE
+
+/*
+ * Deferred coalescing: a freed large block is not coalesced right away but parked on a pending list. It stays
+ * marked as allocated, like a quick list block, so no neighbour merges with it meanwhile. An allocation of the
+ * same size takes it back as it is. Once the pending blocks add up to SF_DEFER_BYTES, or an allocation finds
+ * nothing in the free lists, all of them are coalesced in one sweep: sorted by address, blocks lying next to
+ * each other are freed as one run, so a run costs one coalescing instead of one per block.
+ */
+
+#ifndef SF_DEFER_BYTES
+#define SF_DEFER_BYTES 65536    // Pending bytes that start a sweep.
+#endif
+#define DEFER_SCAN 8            // Newest pending blocks looked at for a block of the exact size.
+
+/*
+ * Pending blocks stay marked as allocated, so freeing one a second time gets past is_valid_header(). Each one
+ * therefore holds its own address, encoded with MAGIC, in its links' prev field while it is pending. The mark is
+ * wiped when the block leaves the list, a block freed again later must not find it in its payload.
+ */
+#define PENDING_MARK(block) ((sf_block*)((uintptr_t)(block) ^ MAGIC))
+
+// The heap's defer_lock guards its pending list. Taken before the tags lock, never while holding it.
+#ifdef SF_LOCK_STRIPED
+#define SF_DEFER_LOCK(heap)   pthread_mutex_lock(&(heap) -> defer_lock)
+#define SF_DEFER_UNLOCK(heap) pthread_mutex_unlock(&(heap) -> defer_lock)
+#else
+#define SF_DEFER_LOCK(heap)
+#define SF_DEFER_UNLOCK(heap)
+#endif
+
+/*
+ * This method parks an allocated large block on the pending list, starting a sweep if that makes too many.
+ */
+void defer_free(sf_heap_t* heap, sf_header* block_header, size_t block_size) {
+    sf_block* block = (sf_block*)(block_header - 1);    // Block struct starts at previous block's footer.
+
+    SF_DEFER_LOCK(heap);
+    if (block -> body.links.prev == PENDING_MARK(block)) {      // Block is pending already, double free.
+        abort();
+    }
+    block -> body.links.next = heap -> pending_first;
+    block -> body.links.prev = PENDING_MARK(block);
+    heap -> pending_first = block;
+    heap -> pending_bytes += block_size;
+    STAT_ADD(heap, deferred_bytes, block_size);
+    int sweep = heap -> pending_bytes >= SF_DEFER_BYTES;
+    SF_DEFER_UNLOCK(heap);
+
+    if (sweep) {
+        defer_sweep(heap);
+    }
+}
+
+/*
+ * This method takes a pending block of exactly `size` bytes back, if one was parked recently.
+ *
+ * @return block marked as allocated, or NULL.
+ */
+sf_block* defer_take(sf_heap_t* heap, size_t size) {
+    sf_block* found = NULL;
+
+    SF_DEFER_LOCK(heap);
+    sf_block** link = &heap -> pending_first;   // Pointer to the link we would rewrite.
+    for (int i = 0; i < DEFER_SCAN && *link != NULL; i++) {
+        if (((((*link) -> header)^MAGIC) & ~0x6) == size) {
+            found = *link;
+            *link = found -> body.links.next;
+            found -> body.links.prev = NULL;
+            heap -> pending_bytes -= size;
+            STAT_SUB(heap, deferred_bytes, size);
+            break;
+        }
+        link = &((*link) -> body.links.next);
+    }
+    SF_DEFER_UNLOCK(heap);
+    return found;
+}
+
+/*
+ * This method sorts a list of blocks by address. Merge sort, as the list has no room for anything else.
+ */
+static sf_block* sort_by_address(sf_block* list, size_t length) {
+    if (length < 2) {
+        return list;
+    }
+    sf_block* second = list;
+    for (size_t i = 1; i < length / 2; i++) {
+        second = second -> body.links.next;
+    }
+    sf_block* rest = second -> body.links.next;
+    second -> body.links.next = NULL;
+
+    sf_block* left = sort_by_address(list, length / 2);
+    sf_block* right = sort_by_address(rest, length - length / 2);
+    sf_block* merged = NULL;
+    sf_block** tail = &merged;
+    while (left != NULL && right != NULL) {
+        if (left == right) {            // Same block parked twice, second free was a double free.
+            abort();
+        }
+        sf_block** smaller = left < right ? &left : &right;
+        *tail = *smaller;
+        tail = &((*smaller) -> body.links.next);
+        *smaller = (*smaller) -> body.links.next;
+    }
+    *tail = left != NULL ? left : right;
+    return merged;
+}
+
+/*
+ * This method coalesces every pending block. Blocks lying next to each other are freed as a single run.
+ * Caller must not hold the tags lock.
+ *
+ * @return 1 if there was any pending block.
+ */
+int defer_sweep(sf_heap_t* heap) {
+    SF_DEFER_LOCK(heap);
+    sf_block* list = heap -> pending_first;
+    size_t bytes = heap -> pending_bytes;
+    heap -> pending_first = NULL;
+    heap -> pending_bytes = 0;
+    SF_DEFER_UNLOCK(heap);
+    if (list == NULL) {
+        return 0;
+    }
+
+    size_t length = 0;
+    for (sf_block* block = list; block != NULL; block = block -> body.links.next) {
+        block -> body.links.prev = NULL;
+        length++;
+    }
+    list = sort_by_address(list, length);
+
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    STAT_SUB(heap, deferred_bytes, bytes);
+    while (list != NULL) {
+        sf_header* run_header = &list -> header;
+        size_t run_size = (*run_header^MAGIC) & ~0x6;
+        for (list = list -> body.links.next; list != NULL && &list -> header == run_header + run_size/8;
+             list = list -> body.links.next) {
+            run_size += (list -> header^MAGIC) & ~0x6;
+        }
+        free_block_run(heap, run_header, run_size);
+    }
+    SF_TAGS_UNLOCK(heap);
+    return 1;
+}
+
+#endif
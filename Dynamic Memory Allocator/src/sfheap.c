@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Created heaps: one mapping holds the heap's struct in its first pages and the heap's own pages after it.
+ * The mapping reserves address space only, so a heap costs memory for the pages it has grown to. Pages are
+ * added by moving mem_end (see heap_page() in sfmm.c), and the whole mapping goes back at once on destroy:
+ *
+ *   +-------------+------------------------------+----------------------+
+ *   | sf_heap_t   | pages in use                 | reserved             |
+ *   +-------------+------------------------------+----------------------+
+ *                 ^ mem_start                    ^ mem_end              ^ mem_limit
+ *
+ * sf_heap_open() maps a file the same way, shared, at a fixed address. Blocks and lists point at each other by
+ * address, so the address is kept in the file and every later mapping goes there as well. The file stays
+ * flock()ed while it is mapped, and file_open in the file tells a clean close from a process that died.
+ * The file's first fields say which build made it: besides sizeof(sf_heap_t), SF_CLASS_STEPS and SF_NUM_CLASSES,
+ * which decide the free list a block size goes to, and the flags that add fields to the struct (HEAP_FILE_FEATURES).
+ * Two builds can agree on the size and still disagree on those, so a file only opens where all of them match.
+ * Boundary tags are stored XOR'ed with MAGIC, which every process picks anew. A process opening a file made under
+ * another MAGIC re-encodes the tags in one pass along the heap, which is the only part of the heap it reads.
+ * With SF_HUGE_PAGES, a created heap's mapping is placed so that mem_start falls on an extent boundary, so that
+ * every extent of the heap can be a huge page. A file keeps its address, its first extent is only partly heap.
+ */
+
+#ifndef SF_HEAP_SIZE
+#define SF_HEAP_SIZE (1L << 30)
+#endif
+
+#ifndef SF_HEAP_BASE
+#define SF_HEAP_BASE 0x500000000000UL
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0           // Older headers: address is a hint, checked after mapping.
+#endif
+
+#define HEAP_HEADER_SIZE (((sizeof(sf_heap_t) + PAGE_SZ - 1) / PAGE_SZ) * PAGE_SZ)
+#define HEAP_FILE_MAGIC 0x7366686561700002UL   // "sfheap", version 2.
+
+#define HEAP_FILE_THREAD_CACHE      0x1
+#define HEAP_FILE_LOCK_STRIPED      0x2
+#define HEAP_FILE_DEFERRED_COALESCE 0x4
+
+#ifdef SF_THREAD_CACHE
+#define HEAP_FILE_FEATURE_TC HEAP_FILE_THREAD_CACHE
+#else
+#define HEAP_FILE_FEATURE_TC 0
+#endif
+#ifdef SF_LOCK_STRIPED
+#define HEAP_FILE_FEATURE_LS HEAP_FILE_LOCK_STRIPED
+#else
+#define HEAP_FILE_FEATURE_LS 0
+#endif
+#ifdef SF_DEFERRED_COALESCE
+#define HEAP_FILE_FEATURE_DC HEAP_FILE_DEFERRED_COALESCE
+#else
+#define HEAP_FILE_FEATURE_DC 0
+#endif
+#define HEAP_FILE_FEATURES (HEAP_FILE_FEATURE_TC | HEAP_FILE_FEATURE_LS | HEAP_FILE_FEATURE_DC)
+
+/*
+ * @return mapping size for a heap of `size` bytes, 0 if that does not fit in a size_t.
+ */
+static size_t heap_mapping_size(size_t size) {
+    if (size == 0) {
+        size = SF_HEAP_SIZE;
+    }
+    if (size > (size_t)-1 - HEAP_HEADER_SIZE - PAGE_SZ) {
+        return 0;
+    }
+    return HEAP_HEADER_SIZE + ((size + PAGE_SZ - 1) / PAGE_SZ) * PAGE_SZ;
+}
+
+/*
+ * This method makes an empty heap at the start of a zeroed mapping. Only fields that start out non-zero are set.
+ */
+static sf_heap_t* heap_init(void* mapping, size_t mapping_size) {
+    sf_heap_t* heap = mapping;
+    heap -> mapping_start = mapping;
+    heap -> mapping_size = mapping_size;
+    heap -> file_fd = -1;
+    heap -> quick_lists = heap -> own_quick_lists;
+    heap -> class_heads = heap -> own_class_heads;
+    heap -> large_index_seed = 2463534242u;
+    heap -> first_page_flag = 1;
+    heap -> mem_start = (char*)mapping + HEAP_HEADER_SIZE;
+    heap -> mem_end = heap -> mem_start;
+    heap -> mem_limit = (char*)mapping + mapping_size;
+    setup_quick_and_free_lists(heap);
+    setup_locks(heap);
+    return heap;
+}
+
+sf_heap_t *sf_heap_create(size_t size) {
+    size_t mapping_size = heap_mapping_size(size);
+    if (mapping_size == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t slack = 0;
+#ifdef SF_HUGE_PAGES
+    slack = SF_HUGE_EXTENT;                 // Room to move mem_start up to an extent boundary.
+#endif
+    char* mapping = mmap(NULL, mapping_size + slack, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+#ifdef SF_HUGE_PAGES
+    size_t aligned_start = ((size_t)mapping + HEAP_HEADER_SIZE + SF_HUGE_EXTENT - 1) & ~(SF_HUGE_EXTENT - 1);
+    char* aligned = (char*)aligned_start - HEAP_HEADER_SIZE;
+    if (aligned > mapping) {
+        munmap(mapping, aligned - mapping);
+    }
+    if (mapping + slack > aligned) {
+        munmap(aligned + mapping_size, mapping + slack - aligned);
+    }
+    mapping = aligned;
+#endif
+    return heap_init(mapping, mapping_size);
+}
+
+/*
+ * This method asks for the extent starting at `extent` to be backed by a huge page, as far as it lies before
+ * limit. Kernel may refuse or do it later, sf_huge_page_bytes() tells what it did.
+ */
+void huge_extent_advise(char* extent, char* limit) {
+    size_t length = SF_HUGE_EXTENT;
+    if ((size_t)(limit - extent) < length) {
+        length = limit - extent;
+    }
+    madvise(extent, length, MADV_HUGEPAGE);
+}
+
+size_t sf_huge_page_bytes(sf_heap_t *heap) {
+    if (heap == NULL) {
+        heap = &sf_default_heap;
+    }
+    size_t start = (size_t)heap_start(heap);
+    size_t end = (size_t)heap_end(heap);
+    FILE* smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) {
+        return 0;
+    }
+
+    // A mapping starts with its address range, followed by one "Field: value kB" line per field.
+    char line[256];
+    int inside = 0;
+    size_t huge_bytes = 0;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        unsigned long from, to;
+        size_t kilobytes;
+        if (sscanf(line, "%lx-%lx ", &from, &to) == 2) {
+            inside = from < end && to > start;
+        }
+        else if (inside && (sscanf(line, "AnonHugePages: %zu kB", &kilobytes) == 1
+                            || sscanf(line, "ShmemPmdMapped: %zu kB", &kilobytes) == 1
+                            || sscanf(line, "FilePmdMapped: %zu kB", &kilobytes) == 1)) {
+            huge_bytes += kilobytes * 1024;
+        }
+    }
+    fclose(smaps);
+    return huge_bytes;
+}
+
+/*
+ * This method closes a heap file that could not be opened.
+ *
+ * @return NULL, with sf_errno set to error.
+ */
+static sf_heap_t* open_failed(int fd, int error) {
+    close(fd);
+    sf_errno = error;
+    return NULL;
+}
+
+/*
+ * This method re-encodes every boundary tag of the heap, stored with tag_magic, with this process's MAGIC.
+ * Walks the heap from block to block, like coalescing would: header of each block, footer of each free block,
+ * plus the paddings at both ends.
+ */
+static void heap_rekey(sf_heap_t* heap) {
+    uint64_t key = heap -> tag_magic ^ MAGIC;
+    heap -> tag_magic = MAGIC;
+    if (key == 0 || heap -> first_page_flag) {
+        return;
+    }
+
+    sf_header* block_header = (sf_header*)heap -> mem_start;
+    sf_header* reserved_footer = (sf_footer*)heap -> mem_end - 1;
+    *block_header++ ^= key;
+    while (block_header < reserved_footer) {
+        *block_header ^= key;
+        size_t block_size = (*block_header^MAGIC) & ~0x6;
+        if (((*block_header^MAGIC) & THIS_BLOCK_ALLOCATED) == 0) {
+            *(block_header + block_size/8 - 1) ^= key;
+        }
+        block_header += block_size/8;
+    }
+    *reserved_footer ^= key;
+}
+
+sf_heap_t *sf_heap_open(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        sf_errno = errno;
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {      // Released by close(), or when the process dies.
+        return open_failed(fd, errno == EWOULDBLOCK ? EBUSY : errno);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        return open_failed(fd, errno);
+    }
+
+    // A new file gets the size asked for, an existing one says where it goes and how big it is.
+    int new_file = file_stat.st_size == 0;
+    void* base = (void*)SF_HEAP_BASE;
+    size_t mapping_size;
+    if (new_file) {
+        mapping_size = heap_mapping_size(size);
+        if (mapping_size == 0) {
+            return open_failed(fd, ENOMEM);
+        }
+        if (ftruncate(fd, mapping_size) == -1) {        // Sparse, blocks take disk space once written.
+            return open_failed(fd, errno);
+        }
+    }
+    else {
+        sf_heap_t header;
+        if (pread(fd, &header, sizeof(sf_heap_t), 0) != sizeof(sf_heap_t) || header.file_magic != HEAP_FILE_MAGIC
+            || header.file_layout != sizeof(sf_heap_t) || header.file_class_steps != SF_CLASS_STEPS
+            || header.file_num_classes != SF_NUM_CLASSES || header.file_features != HEAP_FILE_FEATURES
+            || header.mapping_size != (size_t)file_stat.st_size) {
+            return open_failed(fd, EINVAL);
+        }
+        if (header.file_open) {
+            return open_failed(fd, EIO);
+        }
+        base = header.mapping_start;
+        mapping_size = header.mapping_size;
+    }
+
+    void* mapping = mmap(base, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (mapping != base) {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mapping_size);
+        }
+        if (new_file) {
+            ftruncate(fd, 0);       // Leave it empty rather than a file without a heap.
+        }
+        return open_failed(fd, ENOMEM);
+    }
+
+    sf_heap_t* heap = mapping;
+    if (new_file) {
+        heap_init(mapping, mapping_size);
+        heap -> file_magic = HEAP_FILE_MAGIC;
+        heap -> file_layout = sizeof(sf_heap_t);
+        heap -> file_class_steps = SF_CLASS_STEPS;
+        heap -> file_num_classes = SF_NUM_CLASSES;
+        heap -> file_features = HEAP_FILE_FEATURES;
+        heap -> tag_magic = MAGIC;
+    }
+    else {
+        setup_locks(heap);          // Whatever the locks held in the last process means nothing here.
+        heap_rekey(heap);
+    }
+    heap -> file_fd = fd;
+    heap -> file_open = 1;
+    msync(heap, HEAP_HEADER_SIZE, MS_SYNC);
+    return heap;
+}
+
+void *sf_heap_malloc(sf_heap_t *heap, size_t size) {
+    if (heap == NULL) {
+        return sf_malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > (size_t)(heap -> mem_limit - heap -> mem_start)) {      // Could never fit, also keeps size from wrapping.
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size = adjusted_block_size(size);
+
+    SF_HEAP_LOCK(heap);
+    sf_block* found_mem_block = malloc_block(heap, size);
+    SF_HEAP_UNLOCK(heap);
+
+    if (found_mem_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    return found_mem_block -> body.payload;
+}
+
+void sf_heap_free(sf_heap_t *heap, void *ptr) {
+    if (heap == NULL) {
+        sf_free(ptr);
+        return;
+    }
+
+    SF_HEAP_LOCK(heap);
+    if (!is_valid_header(heap, ptr)) {
+        abort();
+    }
+    free_block(heap, (sf_header*)ptr - 1);
+    SF_HEAP_UNLOCK(heap);
+}
+
+void sf_heap_destroy(sf_heap_t *heap) {
+    if (heap == NULL) {
+        return;
+    }
+    int fd = heap -> file_fd;
+    if (fd != -1) {
+        // Blocks first, then the flag saying they are complete.
+        msync(heap -> mapping_start, heap -> mapping_size, MS_SYNC);
+        heap -> file_open = 0;
+        msync(heap, HEAP_HEADER_SIZE, MS_SYNC);
+    }
+    munmap(heap -> mapping_start, heap -> mapping_size);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void sf_heap_set_root(sf_heap_t *heap, int index, void *ptr) {
+    if (index < 0 || index >= SF_HEAP_ROOTS) {
+        sf_errno = EINVAL;
+        return;
+    }
+    __atomic_store_n(&heap -> roots[index], ptr, __ATOMIC_RELEASE);
+}
+
+void *sf_heap_get_root(sf_heap_t *heap, int index) {
+    if (index < 0 || index >= SF_HEAP_ROOTS) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    return __atomic_load_n(&heap -> roots[index], __ATOMIC_ACQUIRE);
+}
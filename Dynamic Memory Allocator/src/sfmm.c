@@ -1,234 +1,807 @@
+#define _GNU_SOURCE
+#define SF_TRACE_INNER          // Public functions are wrapped by sftrace.c in trace builds.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
 #include "errno.h"
 
 /*
  * Function Proptotypes
  */
-void setup_quick_and_free_lists();
-sf_block* check_quick_lists(size_t size);
-sf_block* check_free_lists(size_t size);
-int mem_grow();
-void* coalescing(sf_header* block_header);
-void add_to_free_list(sf_header* block_header);
+int grow_in_place(sf_heap_t* heap, sf_header* block_header, size_t size);
+sf_block* check_quick_lists(sf_heap_t* heap, size_t size);
+sf_block* check_quick_lists_aligned(sf_heap_t* heap, size_t size, size_t align);
+sf_block* check_free_lists(sf_heap_t* heap, size_t size);
+int mem_grow(sf_heap_t* heap, size_t pages);
+int sf_mem_shrink(size_t pages) __attribute__((weak));
+sf_block* grow_and_carve(sf_heap_t* heap, size_t size);
+void add_clean_pages(sf_heap_t* heap, sf_header* new_block_header);
+void claim_clean(sf_heap_t* heap, sf_header* start, sf_header* end);
+void* coalescing(sf_heap_t* heap, sf_header* block_header);
+void add_to_free_list(sf_heap_t* heap, sf_header* block_header);
+void remove_from_free_list(sf_heap_t* heap, sf_block* block);
+int free_list_index(size_t size);
+void large_index_insert(sf_heap_t* heap, sf_large_block* block);
+void large_index_remove(sf_heap_t* heap, sf_large_block* block);
+sf_large_block* large_index_best_fit(sf_heap_t* heap, size_t size);
+
+void add_to_quick_list(sf_heap_t* heap, sf_header* block_ptr);
+void check_flush(sf_heap_t* heap, int bin_num);
+static void adapt_quick_list(sf_heap_t* heap, int list_location, int hit);
 
-int is_valid_header(void* ptr);
-int belongs_to_quick_list(double size);
-void add_to_quick_list(sf_header* block_ptr);
-void check_flush(int bin_num);
 
+/*
+ * Heap bytes from clean_start up to clean_end are still zero as the heap's pages were handed out: they lie inside
+ * one free block, past its links and before its footer, and no allocation has covered them since. Only kept with
+ * -DSF_MEM_GROW_ZEROED. claim_clean() leaves the part of the last allocated block that was clean in
+ * claimed_start/claimed_end, for sf_calloc() to skip.
+ */
+#ifdef SF_LOCK_STRIPED
+static __thread char* claimed_start;	// Threads allocate at the same time, each needs its own result.
+static __thread char* claimed_end;
+#else
+static char* claimed_start;
+static char* claimed_end;
+#endif
+
+/*
+ * Size classes, see sfmm_internal.h. class_limits[] is CLASS_LIMIT() of every class, worked out by the compiler.
+ */
+#if SF_CLASS_STEPS < 1 || (SF_CLASS_STEPS & (SF_CLASS_STEPS - 1)) != 0
+#error "SF_CLASS_STEPS must be a power of two"
+#endif
+#if SF_NUM_CLASSES > 64
+#error "SF_NUM_CLASSES must be at most 64, one bit of free_list_bitmap each"
+#endif
+#define CLASS_STEPS_BITS __builtin_ctz(SF_CLASS_STEPS)
+
+#if !(SF_CLASS_STEPS == 1 && SF_NUM_CLASSES == NUM_FREE_LISTS)
+sf_block sf_class_heads[SF_NUM_CLASSES];
+#endif
+
+// Blocks of the last class must have room for their skip list pointers.
+typedef char last_class_check[CLASS_LIMIT(SF_NUM_CLASSES - 2) + 16 >= sizeof(sf_large_block) ? 1 : -1];
+
+#define CLASS_LIMITS_4(i)  CLASS_LIMIT(i), CLASS_LIMIT(i + 1), CLASS_LIMIT(i + 2), CLASS_LIMIT(i + 3)
+#define CLASS_LIMITS_16(i) CLASS_LIMITS_4(i), CLASS_LIMITS_4(i + 4), CLASS_LIMITS_4(i + 8), CLASS_LIMITS_4(i + 12)
+static const size_t class_limits[64] = {
+    CLASS_LIMITS_16(0), CLASS_LIMITS_16(16), CLASS_LIMITS_16(32), CLASS_LIMITS_16(48)
+};
+
+/*
+ * Free lists are locked one by one with striped locks, so two threads may flip bits of different lists at the
+ * same time. Bitmap is then updated atomically, a list's own bit is still only changed under that list's lock.
+ */
+#ifdef SF_LOCK_STRIPED
+#define SET_LIST_BIT(heap, index)   __atomic_fetch_or(&(heap) -> free_list_bitmap, 1ul << (index), __ATOMIC_RELAXED)
+#define CLEAR_LIST_BIT(heap, index) __atomic_fetch_and(&(heap) -> free_list_bitmap, ~(1ul << (index)), __ATOMIC_RELAXED)
+#define LIST_BITMAP(heap)           __atomic_load_n(&(heap) -> free_list_bitmap, __ATOMIC_RELAXED)
+#else
+#define SET_LIST_BIT(heap, index)   ((heap) -> free_list_bitmap |= 1ul << (index))
+#define CLEAR_LIST_BIT(heap, index) ((heap) -> free_list_bitmap &= ~(1ul << (index)))
+#define LIST_BITMAP(heap)           ((heap) -> free_list_bitmap)
+#endif
 
-int first_page_flag = 1;		// Global variable to check if first page added to heap.
+/*
+ * Quick lists do not all hold QUICK_LIST_MAX blocks: each list's capacity follows its hit rate (see
+ * adapt_quick_list()), between QUICK_LIST_MIN and QUICK_LIST_LIMIT blocks, and all capacities of a heap
+ * together hold at most SF_QUICK_LIST_BUDGET bytes.
+ */
+#ifndef SF_QUICK_LIST_BUDGET
+#define SF_QUICK_LIST_BUDGET 16384
+#endif
+#define QUICK_LIST_MIN 2
+#define QUICK_LIST_LIMIT 64
+#define QUICK_EPOCH 64			// Requests to a list between two resizes.
+
+sf_heap_t sf_default_heap = {
+    .quick_lists = sf_quick_lists,
+    .class_heads = sf_class_heads,
+    .large_index_seed = 2463534242u,
+    .first_page_flag = 1,
+#if defined(SF_THREAD_CACHE) && !defined(SF_LOCK_STRIPED)
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+#endif
 
 void *sf_malloc(size_t size) {
-	size_t block_size = size;
+    sf_heap_t* heap = &sf_default_heap;
 	if(size == 0) {
         return NULL;
     }
+    size = adjusted_block_size(size);
+    if (size == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_block* found_mem_block;
 
-    else if(size < 24) {
-        if(size < 0){
+    // Huge blocks get a mapping of their own, they never touch the heap.
+    if (size >= SF_MMAP_THRESHOLD) {
+        found_mem_block = mmap_block(size);
+        if(found_mem_block == NULL) {
             sf_errno = ENOMEM;
             return NULL;
         }
-        size = 24;
+        return found_mem_block -> body.payload;
     }
 
-	size += 8;						// Include header size to requested size.
-    if (size%16 != 0) {
-        size += 16 - (size % 16);	// make requested size to be multiple of 16 bytes.
+#ifdef SF_THREAD_CACHE
+    // Small blocks are served from this thread's cache, which refills itself from the shared heap.
+    if (belongs_to_quick_list(size)) {
+        found_mem_block = tcache_malloc(size);
+        if(found_mem_block == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        return found_mem_block -> body.payload;
     }
+#endif
+
+    SF_HEAP_LOCK(heap);
+    found_mem_block = malloc_block(heap, size);
+    SF_HEAP_UNLOCK(heap);
 
-    if (first_page_flag) {
-    	setup_quick_and_free_lists();
+    if(found_mem_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
     }
+    return found_mem_block -> body.payload;
+}
 
-    sf_block* found_mem_block = check_quick_lists(size); // Check quick list for a mem block with requested size.
-    if(found_mem_block != NULL) {
+void *sf_calloc(size_t nmemb, size_t size) {
+    sf_heap_t* heap = &sf_default_heap;
+    if (nmemb == 0 || size == 0) {
+        return NULL;
+    }
+    if (nmemb > (size_t)-1 / size || adjusted_block_size(nmemb * size) == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size_t total_size = nmemb * size;
+    size_t block_size = adjusted_block_size(total_size);
+    sf_block* found_mem_block;
+
+    // A new mapping is zero already.
+    if (block_size >= SF_MMAP_THRESHOLD) {
+        found_mem_block = mmap_block(block_size);
+        if (found_mem_block == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
         return found_mem_block -> body.payload;
     }
 
-    // If requested memory block is found in free list,
-    found_mem_block = check_free_lists(size);
-    if(found_mem_block != NULL) {
-        return found_mem_block -> body.payload;
+#ifdef SF_THREAD_CACHE
+    // Cached blocks have all been used before.
+    if (belongs_to_quick_list(block_size)) {
+        void* payload = sf_malloc(total_size);
+        if (payload != NULL) {
+            memset(payload, 0, total_size);
+        }
+        return payload;
     }
+#endif
 
-    // If we couldn't find a memory block with required size, request a page to our heap.
-    if (mem_grow() != -1) {
-        first_page_flag = 0;
-        // If we successfully added a page to our heap, we call sf_malloc with same size again.
-        // Becase this time we know that there is a available block to allocaet in the free list.
-        found_mem_block = sf_malloc(block_size);
-        return found_mem_block;
-    } else {
+    SF_HEAP_LOCK(heap);
+    claimed_start = NULL;           // Stays empty unless the block is cut out of clean bytes.
+    claimed_end = NULL;
+    found_mem_block = malloc_block(heap, block_size);
+    char* clean_from = claimed_start;
+    char* clean_to = claimed_end;
+    SF_HEAP_UNLOCK(heap);
+
+    if (found_mem_block == NULL) {
         sf_errno = ENOMEM;
         return NULL;
     }
+
+    // Only the bytes before and after the clean part of the block are cleared.
+    char* payload = (char*)found_mem_block -> body.payload;
+    char* payload_end = payload + total_size;
+    if (clean_from < payload) {
+        clean_from = payload;
+    }
+    if (clean_to > payload_end) {
+        clean_to = payload_end;
+    }
+    if (clean_from >= clean_to) {   // Nothing clean in the payload, clear all of it.
+        clean_from = payload_end;
+        clean_to = payload_end;
+    }
+    memset(payload, 0, clean_from - payload);
+    memset(clean_to, 0, payload_end - clean_to);
+    return payload;
+}
+
+/*
+ * This method finds a block of exactly or at least `size` bytes (header included, already rounded to 16)
+ * in the heap, growing the heap as many times as needed. Returned block is marked as allocated.
+ * Caller must hold the heap lock.
+ *
+ * @return found block, or NULL if heap cannot grow any further.
+ */
+sf_block* malloc_block(sf_heap_t* heap, size_t size) {
+    if (heap == &sf_default_heap) {     // Created heaps were set up by sf_heap_create().
+        setup_heap();
+    }
+
+    sf_block* found_mem_block = check_quick_lists(heap, size); // Check quick list for a mem block with requested size.
+    if(found_mem_block != NULL) {
+        stats_note_peak(heap);
+        return found_mem_block;
+    }
+
+#ifdef SF_DEFERRED_COALESCE
+    // A large block of this size may have been freed a moment ago.
+    found_mem_block = defer_take(heap, size);
+    if(found_mem_block != NULL) {
+        stats_note_peak(heap);
+        return found_mem_block;
+    }
+#endif
+
+    // If requested memory block is found in free list,
+    SF_TAGS_SHARED_LOCK(heap);
+    found_mem_block = check_free_lists(heap, size);
+    SF_TAGS_UNLOCK(heap);
+    if(found_mem_block != NULL) {
+        stats_note_peak(heap);
+        return found_mem_block;
+    }
+
+    // If we couldn't find a memory block with required size, grow the heap by as many pages as it takes
+    // and cut the block out of the new end of the heap.
+    // Lists are searched once more before growing, another thread may have freed a block meanwhile.
+#ifdef SF_DEFERRED_COALESCE
+    defer_sweep(heap);                  // Parked blocks may coalesce into one that fits.
+#endif
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    found_mem_block = check_free_lists(heap, size);
+    if (found_mem_block == NULL) {
+        found_mem_block = grow_and_carve(heap, size);
+    }
+    SF_TAGS_UNLOCK(heap);
+    if (found_mem_block != NULL) {
+        stats_note_peak(heap);
+    }
+    return found_mem_block;
 }
 
 void sf_free(void *pp) {
+    sf_heap_t* heap = &sf_default_heap;
     sf_header* block_ptr = (sf_header*)pp;      // Cast void pointer to row pointer.
 
-	if(!is_valid_header(block_ptr))
+    // Huge blocks go straight back to the OS.
+    if (is_valid_block(heap, pp) && IS_MMAPPED(block_ptr - 1)) {
+        munmap_block(block_ptr - 1);
+        return;
+    }
+
+#ifdef SF_THREAD_CACHE
+    if(tcache_free(pp)) {                       // Small blocks go back to this thread's cache.
+        return;
+    }
+#endif
+
+    SF_HEAP_LOCK(heap);
+	if(!is_valid_header(heap, block_ptr))
 		abort();
 
-    sf_header* block_header = --block_ptr;      // Get the header field of this block
+    free_block(heap, --block_ptr);
+    SF_HEAP_UNLOCK(heap);
+}
+
+void sf_free_sized(void *pp, size_t size) {
+    sf_heap_t* heap = &sf_default_heap;
+    if (pp == NULL || size == 0) {
+        abort();
+    }
+    sf_header* block_header = (sf_header*)pp - 1;
+    size_t header_value = *block_header^MAGIC;          // Only decode of the header on this path.
+    size_t block_size = adjusted_block_size(size);
+
+    // Huge blocks: size must be a huge size, and header a valid mapping.
+    if (header_value & MMAPPED_BLOCK) {
+        if (block_size < SF_MMAP_THRESHOLD || !is_valid_mmapped_block(block_header)) {
+            abort();
+        }
+        munmap_block(block_header);
+        return;
+    }
+
+    // Block may be up to 16 bytes larger than asked for, when the rest would have been a splinter.
+    size_t header_size = header_value & ~0x6;
+    if ((header_value & (THIS_BLOCK_ALLOCATED | 0x9)) != THIS_BLOCK_ALLOCATED ||
+        header_size < block_size || header_size > block_size + 16) {
+        abort();
+    }
 
+#ifdef SF_THREAD_CACHE
+    if (tcache_free_block(block_header, header_size)) {
+        return;
+    }
+#endif
+    SF_HEAP_LOCK(heap);
+    free_block(heap, block_header);
+    SF_HEAP_UNLOCK(heap);
+}
+
+/*
+ * This method returns an allocated block to the heap. Small blocks go to their quick list, others are coalesced
+ * and put to a free list. Caller must hold the heap lock.
+ */
+void free_block(sf_heap_t* heap, sf_header* block_header) {
     size_t mem_size = (*block_header^MAGIC) & ~0x6;	// Get the memory Size of block
 
     // Find out where would this block would go after freeing it.
     if(belongs_to_quick_list(mem_size)) {
-        add_to_quick_list(block_header);
+        add_to_quick_list(heap, block_header);
     }
     else {
-    	// perform coalescing before sending it to freelist.
-    	sf_header* block_ptr2 = block_header;
-    	*block_ptr2 = ((*block_header^MAGIC) & ~THIS_BLOCK_ALLOCATED)^MAGIC;		// Set this block's header alloc. bit to 0.
-
-    	block_ptr2 = block_ptr2 + ((*block_header^MAGIC) & ~0x6)/8 - 1;
-    	*block_ptr2 = ((*block_header^MAGIC) & ~THIS_BLOCK_ALLOCATED)^MAGIC;		// Set this block's footer alloc. bit to 0.
-        void* free_block_to_add = coalescing(block_header);
-        add_to_free_list(free_block_to_add);
+#ifdef SF_DEFERRED_COALESCE
+        defer_free(heap, block_header, mem_size);
+        return;
+#endif
+    	SF_TAGS_EXCLUSIVE_LOCK(heap);
+        free_block_run(heap, block_header, mem_size);
+        SF_TAGS_UNLOCK(heap);
     }
+}
 
+/*
+ * This method frees `size` bytes of allocated blocks starting at block_header, as a single block: it is marked
+ * free, coalesced with its free neighbours and put to a free list. `size` may cover several adjacent blocks,
+ * their headers simply become part of the free block. With striped locks, caller must hold the tags lock
+ * exclusively.
+ */
+void free_block_run(sf_heap_t* heap, sf_header* block_header, size_t size) {
+	// perform coalescing before sending it to freelist.
+	*block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | size)^MAGIC;	// Set this block's header alloc. bit to 0.
+	sf_footer* block_footer = block_header + size/8 - 1;
+	*block_footer = *block_header;													// Set this block's footer alloc. bit to 0.
+    void* free_block_to_add = coalescing(heap, block_header);
+    add_to_free_list(heap, free_block_to_add);
+    // Large free blocks give their pages back right away.
+    size_t free_size = (*(sf_header*)free_block_to_add^MAGIC) & ~0x6;
+    if (SF_TRIM_THRESHOLD > 0 && free_size >= SF_TRIM_PAD + SF_TRIM_THRESHOLD) {
+        trim_free_block(heap, free_block_to_add);
+    }
 }
 
 void *sf_realloc(void *pp, size_t rsize) {
+    sf_heap_t* heap = &sf_default_heap;
     sf_header* block_ptr = pp;
 
-    if (!is_valid_header(block_ptr)) {	// Validate the block.
+    SF_HEAP_LOCK(heap);
+    if (!is_valid_header(heap, block_ptr)) {	// Validate the block.
     	sf_errno = EINVAL;
         abort();
     }
+    SF_HEAP_UNLOCK(heap);
 
     block_ptr--;                // Move pointer to header.
 
     if(rsize == 0){ 			// if requested size is 0, free the block
         sf_free(pp);
-        return pp;
+        return NULL;
     }
 
-    size_t new_block_size = rsize;
+    size_t new_block_size = adjusted_block_size(rsize);
+    if (new_block_size == 0) {              // Block is left as it was, like any failed realloc.
+        sf_errno = ENOMEM;
+        return NULL;
+    }
     size_t block_size = ((*block_ptr^MAGIC) & ~0x6);
 
-    if(rsize < 24) {
-        if(rsize < 0){
-            sf_errno = ENOMEM;
+    // Huge block: kernel resizes the mapping, unless it became small enough to move into the heap.
+    if (IS_MMAPPED(block_ptr)) {
+        sf_block* resized_block;
+        if (new_block_size >= SF_MMAP_THRESHOLD) {
+            resized_block = mremap_block(block_ptr, new_block_size);
+            if (resized_block == NULL) {
+                sf_errno = ENOMEM;
+                return NULL;
+            }
+            return resized_block -> body.payload;
+        }
+        void* new_payload = sf_malloc(rsize);
+        if (new_payload == NULL) {
             return NULL;
         }
-        new_block_size = 24;
-    }
-
-    new_block_size += 8;                      // Include header size to requested size.
-    if (new_block_size%16 != 0) {
-        new_block_size += 16 - (new_block_size % 16);   // make requested size to be multiple of 16 bytes.
+        memcpy(new_payload, pp, rsize);			// Block is shrinking, requested size is all that is kept.
+        munmap_block(block_ptr);
+        return new_payload;
     }
 
     // We need to expand block size
     if (new_block_size > block_size) {
+        // First try to take the space right after the block, so nothing has to be copied.
+        // Blocks growing past the threshold are moved to a mapping instead.
+        if (new_block_size < SF_MMAP_THRESHOLD) {
+            SF_HEAP_LOCK(heap);
+            int grown = grow_in_place(heap, block_ptr, new_block_size);
+            SF_HEAP_UNLOCK(heap);
+            if (grown) {
+                return pp;
+            }
+        }
+
         sf_header* new_block_header = sf_malloc(rsize);		// Allocate new block that has paylaod of requested size
         if(new_block_header == NULL){ 						// if sf_malloc returns null, sf_realloc should also return null
             return NULL;
         }
-        new_block_header--;
-        sf_header reallocated_header = ((*new_block_header^MAGIC));
-        memcpy(new_block_header, block_ptr, block_size);	// Copy the previous block to next block, till the end of first block.
-        *new_block_header = (reallocated_header^MAGIC);		// Copy the header value back to generated block.
+        memcpy(new_block_header, pp, block_size - 8);		// Copy the whole payload of previous block.
         sf_free(pp);										// Free prevoius block and add it to freelist.
-        return ++new_block_header;
+        return new_block_header;
     }
 	// We need to shrink block size.
     else {
         // Check if the remaining splinter's size is greater than 32.
         if ((block_size - (new_block_size) >= 32)) {
-            // Splitter block goes to top part.
-            *block_ptr = (((*block_ptr^MAGIC) & PREV_BLOCK_ALLOCATED) + (block_size - new_block_size))^MAGIC;   // Update splitter block header.
-            sf_header* splinter_header = block_ptr;
-            block_ptr += (block_size - new_block_size)/8 - 1;
-            *block_ptr = ((*splinter_header^MAGIC)^MAGIC);   // Update splinter block footer.
+            SF_HEAP_LOCK(heap);
+            // Block keeps its address and payload, the splinter is cut off from its end and freed on its own.
+            sf_header* splinter_header = block_ptr + new_block_size/8;
+            SF_TAGS_EXCLUSIVE_LOCK(heap);       // Neighbours may be setting a bit of our header.
+            *splinter_header = ((block_size - new_block_size) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)^MAGIC;
+            *block_ptr = (((*block_ptr^MAGIC) & PREV_BLOCK_ALLOCATED) | new_block_size | THIS_BLOCK_ALLOCATED)^MAGIC;
+            SF_TAGS_UNLOCK(heap);
+            free_block(heap, splinter_header);
+            SF_HEAP_UNLOCK(heap);
+        }
+        // If remaining splinter's size is less than 32, then we don't need to perform coalesing. Return same pointer back.
+        return pp;
+    }
+}
 
-            block_ptr++;
-            sf_header* shrunk_header = block_ptr;
-            *shrunk_header = (new_block_size + THIS_BLOCK_ALLOCATED)^MAGIC; // Update header of shrunk block
+/*
+ * This method grows an allocated block in place to `size` bytes, by absorbing the free block right after it.
+ * If that is not enough and the block is at the end of the heap (directly, or followed only by a free block),
+ * pages are added to the heap until it is. Whatever is left over after `size` bytes goes back to a free list.
+ * Caller must hold the heap lock.
+ *
+ * @return 1 if block now has at least `size` bytes, 0 if it could not grow and is unchanged.
+ */
+int grow_in_place(sf_heap_t* heap, sf_header* block_header, size_t size) {
+    size_t block_size = (*block_header^MAGIC) & ~0x6;
+    int grown = 0;
+
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    sf_header* end_padding = (sf_header*)heap_end(heap) - 1;     // Padding row after the last block.
+    while (1) {
+        sf_header* next_header = block_header + block_size/8;
+        size_t next_size = (*next_header^MAGIC) & ~0x6;
+        int next_is_free = ((*next_header^MAGIC) & THIS_BLOCK_ALLOCATED) == 0;
+
+        if (next_is_free && block_size + next_size >= size) {
+            remove_from_free_list(heap, (sf_block*)(next_header - 1));
+            size_t combined_size = block_size + next_size;
+
+            if (combined_size - size >= 32) {
+                // Leftover becomes a free block of its own. Block after it already has its prev bit cleared.
+                sf_header* splinter_header = block_header + size/8;
+                *splinter_header = ((combined_size - size) | PREV_BLOCK_ALLOCATED)^MAGIC;
+                *(block_header + combined_size/8 - 1) = *splinter_header;     // Footer of the leftover.
+                *block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | size | THIS_BLOCK_ALLOCATED)^MAGIC;
+                add_to_free_list(heap, splinter_header);
+                claim_clean(heap, next_header, splinter_header);
+            }
+            else {
+                // Whole free block is taken, block after it now has an allocated block before it.
+                *block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | combined_size | THIS_BLOCK_ALLOCATED)^MAGIC;
+                sf_header* after_header = block_header + combined_size/8;
+                *after_header = ((*after_header^MAGIC) | PREV_BLOCK_ALLOCATED)^MAGIC;
+                claim_clean(heap, next_header, after_header);
+            }
+            grown = 1;
+            break;
+        }
 
-		    block_ptr = coalescing(splinter_header);          // Perform coalescing, if neccessary.
-            add_to_free_list(block_ptr);        			  // Add this splitter block to free list.
+        // Heap can only help if nothing allocated sits between this block and the end of the heap.
+        int at_heap_end = next_header == end_padding || (next_is_free && next_header + next_size/8 == end_padding);
+        if (!at_heap_end) {
+            break;
+        }
+        size_t missing_size = size - block_size - (next_is_free ? next_size : 0);
+        if (mem_grow(heap, (missing_size + PAGE_SZ - 1) / PAGE_SZ) == -1) {
+            break;
+        }
+        end_padding = (sf_header*)heap_end(heap) - 1;            // New page is coalesced into the free block after us.
+    }
+    SF_TAGS_UNLOCK(heap);
+    if (grown) {
+        stats_note_peak(heap);
+    }
+    return grown;
+}
 
-            return ++shrunk_header;
+void *sf_memalign(size_t size, size_t align) {
+    sf_heap_t* heap = &sf_default_heap;
+    // Alignment must be a power of two, no smaller than a block.
+    if (align < 32 || (align & (align - 1)) != 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    size_t block_size = adjusted_block_size(size);
+    if (block_size == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    // Small blocks of 32 or 64 byte alignment: every other or every fourth quick list block already fits.
+    // Without striped locks, quick lists are guarded by the heap lock, which thread caches take to drain.
+    if (align <= 64 && belongs_to_quick_list(block_size)) {
+        SF_HEAP_LOCK(heap);
+        setup_heap();
+        sf_block* quick_block = check_quick_lists_aligned(heap, block_size, align);
+        SF_HEAP_UNLOCK(heap);
+        if (quick_block != NULL) {
+            return quick_block -> body.payload;
         }
-        // If remaining splinter's size is less than 32, then we don't need to perform coalesing. Return same pointer back.
-        return pp;
     }
+
+    // Payloads are already 16 byte aligned, so the aligned payload is at most align + 16 bytes in. Leading
+    // slack is either 0 or at least 32 bytes, so it can always become a block of its own.
+    size_t total_size = block_size + align + 16;
+    if (total_size < block_size) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    SF_HEAP_LOCK(heap);
+    sf_block* found_mem_block = malloc_block(heap, total_size);
+    if (found_mem_block == NULL) {
+        SF_HEAP_UNLOCK(heap);
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_header* block_header = &(found_mem_block -> header);
+    size_t found_size = (*block_header^MAGIC) & ~0x6;
+    size_t lead_size = (align - ((size_t)found_mem_block -> body.payload & (align - 1))) & (align - 1);
+    if (lead_size != 0 && lead_size < 32) {
+        lead_size += align;
+    }
+
+    // Leading slack: cut it off as an allocated block right before the aligned one, then free it as usual.
+    // Freeing it clears PREV_BLOCK_ALLOCATED of the aligned block, if the slack ends up in a free list.
+    // Headers are rewritten under the tags lock: splitting the free block below sets a bit in our header.
+    sf_header* lead_header = NULL;
+    sf_header* trail_header = NULL;
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    if (lead_size != 0) {
+        sf_header* aligned_header = block_header + lead_size/8;
+        *aligned_header = ((found_size - lead_size) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)^MAGIC;
+        *block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | lead_size | THIS_BLOCK_ALLOCATED)^MAGIC;
+        lead_header = block_header;
+        block_header = aligned_header;
+        found_size -= lead_size;
+    }
+
+    // Trailing slack: same thing after the aligned block, unless it is too small to be a block.
+    if (found_size - block_size >= 32) {
+        trail_header = block_header + block_size/8;
+        *trail_header = ((found_size - block_size) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)^MAGIC;
+        *block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | block_size | THIS_BLOCK_ALLOCATED)^MAGIC;
+    }
+    SF_TAGS_UNLOCK(heap);
+
+    if (lead_header != NULL) {
+        free_block(heap, lead_header);
+    }
+    if (trail_header != NULL) {
+        free_block(heap, trail_header);
+    }
+    SF_HEAP_UNLOCK(heap);
+
+    return block_header + 1;
+}
+
+/*
+ * This method turns a requested payload size into a block size: header included, at least 32 bytes,
+ * rounded up to a multiple of 16 bytes.
+ *
+ * @return The block size, or 0 if it does not fit in a size_t. Callers report that as ENOMEM.
+ */
+size_t adjusted_block_size(size_t size) {
+    if(size < 24) {
+        size = 24;
+    }
+    if (size > (size_t)-1 - 23) {	// Adding the header and rounding up would wrap around.
+        return 0;
+    }
+	size += 8;						// Include header size to requested size.
+    if (size%16 != 0) {
+        size += 16 - (size % 16);	// make requested size to be multiple of 16 bytes.
+    }
+    return size;
+}
+
+/*
+ * The default heap's mutex has a static initialiser: the first allocation calls setup_heap() while holding
+ * it. Striped locks have none, they are set up here, before any of them is taken.
+ */
+static void setup_default_heap() {
+    setup_quick_and_free_lists(&sf_default_heap);
+#ifdef SF_LOCK_STRIPED
+    setup_locks(&sf_default_heap);
+#endif
+}
+
+/*
+ * This method sets up the quick and free lists of the default heap on the first allocation, exactly once.
+ * Other heaps are set up when they are created.
+ */
+void setup_heap() {
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+    pthread_once(&setup_once, setup_default_heap);
+#else
+    if (sf_default_heap.first_page_flag) {
+    	setup_default_heap();
+    }
+#endif
 }
 
 /*
  * This method sets quicklist's length to 0 to indicate that this list has no block in it. List's first field
  * set to nothing.
  */
-void setup_quick_and_free_lists() {
+void setup_quick_and_free_lists(sf_heap_t* heap) {
+    heap -> quick_list_budget_used = 0;
 	for (int index = 0; index < NUM_QUICK_LISTS; index++) {
-	    sf_quick_lists[index].length = 0;
+	    heap -> quick_lists[index].length = 0;
+	    heap -> quick_list_states[index].capacity = QUICK_LIST_MAX;
+	    heap -> quick_list_states[index].requests = 0;
+	    heap -> quick_list_states[index].hits = 0;
+	    heap -> quick_list_states[index].flushes = 0;
+	    heap -> quick_list_states[index].low_water = 0;
+	    heap -> quick_list_budget_used += QUICK_LIST_MAX * (32 + 16 * index);
     }
 
     // In each free list, there is a dummy. It should look itself.
-    for (int index = 0; index < NUM_FREE_LISTS; index++) {
-        sf_free_list_heads[index].body.links.prev = &sf_free_list_heads[index];
-        sf_free_list_heads[index].body.links.next = &sf_free_list_heads[index];
+    for (int index = 0; index < SF_NUM_CLASSES; index++) {
+        heap -> class_heads[index].body.links.prev = &heap -> class_heads[index];
+        heap -> class_heads[index].body.links.next = &heap -> class_heads[index];
+    }
+    heap -> free_list_bitmap = 0;
+    for (int level = 0; level < LARGE_INDEX_LEVELS; level++) {
+        heap -> large_index_head.forward[level] = NULL;
     }
 }
 
+/*
+ * This method initialises the heap's locks. Also used by a forked child, whose copies of the locks may have
+ * been held by the parent and cannot be unlocked from another thread id.
+ */
+void setup_locks(sf_heap_t* heap) {
+#if defined(SF_THREAD_CACHE) && !defined(SF_LOCK_STRIPED)
+    pthread_mutex_init(&heap -> mutex, NULL);
+#endif
+#ifdef SF_LOCK_STRIPED
+    // Writers are preferred, otherwise a steady stream of allocations could keep coalescing out forever.
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&heap -> tags_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+        pthread_mutex_init(&heap -> quick_list_locks[index], NULL);
+    }
+    for (int index = 0; index < SF_NUM_CLASSES; index++) {
+        pthread_mutex_init(&heap -> free_list_locks[index], NULL);
+    }
+#ifdef SF_DEFERRED_COALESCE
+    pthread_mutex_init(&heap -> defer_lock, NULL);
+#endif
+#endif
+}
+
 /*
  * This method checks quick lists to find a memory block that satisfies the size requirment.
  */
-sf_block* check_quick_lists(size_t size) {
+sf_block* check_quick_lists(sf_heap_t* heap, size_t size) {
 	// Compare requested size with largest mem. in the quick list.
     if (size > 176) {
         return NULL;
     }
     else {
-        if (sf_quick_lists[(size-32)/16].length == 0) {	// Check if list contains any available block
+        SF_QUICK_LIST_LOCK(heap, (size-32)/16);
+        if (heap -> quick_lists[(size-32)/16].length == 0) {	// Check if list contains any available block
+            STAT_ADD(heap, quick_list_misses, 1);
+            adapt_quick_list(heap, (size-32)/16, 0);
+            SF_QUICK_LIST_UNLOCK(heap, (size-32)/16);
             return NULL;
         }
         // If such memory block exist, remove it from the top of stack.
         else {
             sf_header* block_pointer;								// Block pointer for pointer arithmetic.
-            block_pointer = &(sf_quick_lists[ (size-32)/16 ].first->header);	// Get the header of first mem. block in the list.
+            block_pointer = &(heap -> quick_lists[ (size-32)/16 ].first->header);	// Get the header of first mem. block in the list.
             block_pointer--;                                        // Move pointer to previous blocks footer.
             sf_block* block_to_return = (sf_block*) block_pointer;  // Construct a sf_block pointer for the found memory block.
-            sf_quick_lists[ (size-32)/16 ].length--;
-            sf_quick_lists[ (size-32)/16 ].first = sf_quick_lists[ (size-32)/16 ].first -> body.links.next; // Remove block form the top.
+            heap -> quick_lists[ (size-32)/16 ].length--;
+            heap -> quick_lists[ (size-32)/16 ].first = heap -> quick_lists[ (size-32)/16 ].first -> body.links.next; // Remove block form the top.
+            STAT_ADD(heap, quick_list_hits, 1);
+            STAT_SUB(heap, quick_list_bytes, size);
+            adapt_quick_list(heap, (size-32)/16, 1);
+            SF_QUICK_LIST_UNLOCK(heap, (size-32)/16);
             return block_to_return;
         }
     }
 }
 
+/*
+ * This method looks through the quick list of given size for a block whose payload is aligned to `align`,
+ * and takes it out of the list. Quick lists are short, so this is a handful of pointer reads.
+ *
+ * @return found block, or NULL if no block in the list is aligned.
+ */
+sf_block* check_quick_lists_aligned(sf_heap_t* heap, size_t size, size_t align) {
+    int list_location = (size-32)/16;
+    sf_block* block_to_return = NULL;
+
+    SF_QUICK_LIST_LOCK(heap, list_location);
+    sf_block** link = &heap -> quick_lists[list_location].first;  // Pointer to the link we would rewrite.
+    for (int i = 0; i < heap -> quick_lists[list_location].length; i++) {
+        sf_block* block = *link;
+        if (((size_t)block -> body.payload & (align - 1)) == 0) {
+            *link = (*link) -> body.links.next;          // Unlink it, the rest of the list keeps its order.
+            heap -> quick_lists[list_location].length--;
+            STAT_ADD(heap, quick_list_hits, 1);
+            STAT_SUB(heap, quick_list_bytes, size);
+            block_to_return = block;
+            break;
+        }
+        link = &((*link) -> body.links.next);
+    }
+    SF_QUICK_LIST_UNLOCK(heap, list_location);
+    return block_to_return;
+}
+
 /*
  * This method checks free list heads to find a memory block that satisfies size requirment.
+ * Only lists marked in free_list_bitmap are visited, starting from the list of requested size. Every block
+ * in a list above that one is large enough, so after the first list the search ends at the first block.
+ * With striped locks, caller must hold the tags lock, shared or exclusive. Each list is locked
+ * while it is searched, and the list of the found block stays locked until the block is split.
  */
-sf_block* check_free_lists(size_t size) {
+sf_block* check_free_lists(sf_heap_t* heap, size_t size) {
 	sf_block* block_to_return;
 
-    int list_location = -1;
+    int list_location = free_list_index(size);
     int mem_block_flag = 0;
-    int list_upper_range = 32;
-
-    for(int i=0; i<10; i++) {
-        if(size <= list_upper_range) {
-            list_location = i;
-            break;
-        } else {
-        	list_upper_range *= 2;
+    unsigned long candidate_lists = LIST_BITMAP(heap) & (~0ul << list_location);	// Non-empty lists that may fit.
+
+    for (; candidate_lists != 0; candidate_lists &= candidate_lists - 1) {   // Start checking each list
+        int i = __builtin_ctzl(candidate_lists);
+        SF_FREE_LIST_LOCK(heap, i);
+        list_location = i;
+
+        // Last list is searched through its skip list, for the smallest block that is large enough.
+        if (i == SF_NUM_CLASSES - 1) {
+            block_to_return = (sf_block*)large_index_best_fit(heap, size);
+            if (block_to_return != NULL) {
+                remove_from_free_list(heap, block_to_return);
+                mem_block_flag = 1;
+                break;
+            }
+            SF_FREE_LIST_UNLOCK(heap, i);
+            continue;
         }
-    }
 
-    if (list_location == -1) list_location = 9;     	// If requested size is too large, just look at last list.
-
-    for (int i = list_location; i < 10; i++) {          // Start checking each list
-        sf_block* list_dummy = &sf_free_list_heads[i];
+        sf_block* list_dummy = &heap -> class_heads[i];
         for (
             sf_block* mem_block = list_dummy -> body.links.next;  // Set a sf_block pointer to first mem block after dummy.
             mem_block != list_dummy;                // While mem_block is not equal to dummy, keep loop going.
@@ -238,14 +811,14 @@ sf_block* check_free_lists(size_t size) {
                 mem_block_flag = 1;               				// Need to break out of outter loop.
 
                 block_to_return = mem_block;            // Save this mem. block
-                (mem_block -> body.links.prev) -> body.links.next = mem_block -> body.links.next;   // Remove mem_block from the free list.
-                (mem_block -> body.links.next) -> body.links.prev = mem_block -> body.links.prev;
+                remove_from_free_list(heap, mem_block);       // Remove mem_block from the free list.
                 break;
             }
         }
         if (mem_block_flag == 1) {
             break;
         }
+        SF_FREE_LIST_UNLOCK(heap, i);
     }
 
     // If we couldn't find a mem block with satisfactory size, return NULL.
@@ -259,7 +832,9 @@ sf_block* check_free_lists(size_t size) {
         *block_pointer = ((*block_pointer^MAGIC) | THIS_BLOCK_ALLOCATED)^MAGIC;		// set header of mem. block's allocated bit to 1.
         block_pointer += ((*block_pointer^MAGIC) & ~0x6)/8;   						// move block pointer to next block's header
         *block_pointer = ((*block_pointer^MAGIC) | PREV_BLOCK_ALLOCATED)^MAGIC;		// Set next block's previos block alloc. bit to 1.
+        claim_clean(heap, &(block_to_return -> header), block_pointer);
 
+        SF_FREE_LIST_UNLOCK(heap, list_location);
         return block_to_return;
     }
     // If we will have some splitters with the found mem. block,
@@ -273,6 +848,7 @@ sf_block* check_free_lists(size_t size) {
         block_pointer++;                                    			// move the pointer to the header of the block to be allocated
         *block_pointer = (size + THIS_BLOCK_ALLOCATED)^MAGIC;           // update header of allocated block, set allocation bit
         block_pointer += size/8;                            			// move to the header of the next block
+        claim_clean(heap, splinter_footer + 1, block_pointer);
 
         *block_pointer = ((*block_pointer^MAGIC) | PREV_BLOCK_ALLOCATED)^MAGIC;		// set prev_allocated bit of header to 1
         block_to_return = (sf_block*)splinter_footer;					// Construct a sf_block struct for for found mem. block for bottom part of free mem block.
@@ -282,17 +858,26 @@ sf_block* check_free_lists(size_t size) {
             *block_pointer = ((*block_pointer^MAGIC) | PREV_BLOCK_ALLOCATED)^MAGIC;	// set prev_allocated bit of footer to 1
         }
 
-        add_to_free_list(splinter_header);                        		// put the splinter in free list
+        // put the splinter in free list. Its list is never above the one we are holding, so taking it cannot deadlock.
+        int splinter_location = free_list_index((*splinter_header^MAGIC) & ~0x6);
+        if (splinter_location != list_location) {
+            SF_FREE_LIST_LOCK(heap, splinter_location);
+        }
+        add_to_free_list(heap, splinter_header);
+        if (splinter_location != list_location) {
+            SF_FREE_LIST_UNLOCK(heap, splinter_location);
+        }
+        SF_FREE_LIST_UNLOCK(heap, list_location);
         return block_to_return;
     }
 }
 
 /*
- *	This method performs coalescing on passed block. This method can be called from sf_mem_grow(), sf_free(), and flush().
+ *	This method performs coalescing on passed block. This method can be called from mem_grow(), sf_free(), and flush().
  * 	It checks adjecent memory block in memory and if they are free, they are removed from their location free list. Then
  *  they are coalesed them with passed block and returns passed header, with possibly different memory address.
  */
-void* coalescing(sf_header* block_header) {
+void* coalescing(sf_heap_t* heap, sf_header* block_header) {
 	sf_header* block_pointer = block_header;					// Create a blokc pointer in memory for ease of use.
 	sf_footer* current_block_footer = block_pointer + ((*block_pointer^MAGIC) & ~0x6)/8 - 1;	// Save curent block's footer.
 	block_pointer = block_header;								// Move block pointer back to current block's header.
@@ -305,16 +890,16 @@ void* coalescing(sf_header* block_header) {
 	size_t prev_block_size = (*prev_footer^MAGIC) & ~0x6;				// Save the prev block's size
 	size_t next_block_size = (*next_header^MAGIC) & ~0x6;				// Save the next block's size
 
-	// If prev block is free, first remove it from sf_free_list_heads. Later, perform coalesing to it,
+	// If prev block is free, first remove it from class_heads. Later, perform coalesing to it,
 	// update proper header and footer fields. Since prev block is free, we dont need to change this block bit
 	// or prev block bit.
 	if (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) != PREV_BLOCK_ALLOCATED) {
 		block_pointer = prev_footer;							// Set block pointer to prev block footer.
 		block_pointer -= prev_block_size/8;						// Move pointer to prev footer of previous block struct field.
 		sf_block* prev_block = (sf_block*)(block_pointer);		// Get prev block as a sf_block structure.
-		// Remove previoys block from its location in sf_free_list_heads, so that we can safely coalesce.
-		(prev_block -> body.links.prev) -> body.links.next = prev_block -> body.links.next;
-		(prev_block -> body.links.next) -> body.links.prev = prev_block -> body.links.prev;
+		// Remove previoys block from its location in class_heads, so that we can safely coalesce.
+		remove_from_free_list(heap, prev_block);
+		STAT_ADD(heap, coalesces, 1);
 		//Now, move onto coalescing part.
 		block_pointer = prev_footer;
 		sf_header* prev_header = (block_pointer-(prev_block_size/8-1));		// Save prev block's header.
@@ -329,8 +914,8 @@ void* coalescing(sf_header* block_header) {
 		block_pointer = current_block_footer;					// Set block pointer to current block's footer.
 		sf_block* next_block = (sf_block*)(block_pointer);		// Get next block as a sf_block structure.
 		// Remove next block from its location in free list heads.
-		(next_block -> body.links.prev) -> body.links.next = next_block -> body.links.next;
-		(next_block -> body.links.next) -> body.links.prev = next_block -> body.links.prev;
+		remove_from_free_list(heap, next_block);
+		STAT_ADD(heap, coalesces, 1);
 		// Now move onto coalescing part.
 		block_pointer = next_header;
 		sf_footer* next_footer = (block_pointer+next_block_size/8-1);		//Save next block's footer.
@@ -348,60 +933,233 @@ void* coalescing(sf_header* block_header) {
 
 /*
  *	Purpose of this method is to add passed block header to free list. This method gets called right after coalesing(), or
- *  after mem_grow().
+ *  after mem_grow(). With striped locks, caller must hold the list's lock or the tags lock exclusively.
  */
-void add_to_free_list(sf_header* block_header) {
+void add_to_free_list(sf_heap_t* heap, sf_header* block_header) {
     sf_header* block_pointer = block_header;
     sf_block* current_block = (sf_block*)(--block_pointer);
     size_t current_block_size = ((*block_header^MAGIC) & ~0x6);   // get the current block size
 
     // Find which list this mem. block resides in free_list.
-    int list_location = -1;
-    int list_upper_range = 32;
-
-    for(int i=0; i<10; i++) {
-        if(current_block_size <= list_upper_range) {
-            list_location = i;
-            break;
-        } else {
-        	list_upper_range *= 2;
-        }
-    }
-
-    if(list_location == -1){	// If size is too large, just add it to last list.
-        list_location = 9;
-    }
+    int list_location = free_list_index(current_block_size);
 
     // Find proper dummy node in free list.
-    sf_block* dummy = &sf_free_list_heads[list_location];
+    sf_block* dummy = &heap -> class_heads[list_location];
     // Place current block into doubly linked list, right afte dummy node.
     current_block -> body.links.next = dummy -> body.links.next;
     current_block -> body.links.prev = dummy;
     (dummy -> body.links.next) -> body.links.prev = current_block;
     dummy -> body.links.next = current_block;
+    SET_LIST_BIT(heap, list_location);
+    STAT_ADD(heap, free_list_bytes[list_location], current_block_size);
+
+    if (list_location == SF_NUM_CLASSES - 1) {
+        large_index_insert(heap, (sf_large_block*)current_block);
+    }
+}
+
+/*
+ * This method unlinks a block from the free list it is in. If that leaves the list with only its dummy,
+ * the list is marked as empty in free_list_bitmap.
+ */
+void remove_from_free_list(sf_heap_t* heap, sf_block* block) {
+    (block -> body.links.prev) -> body.links.next = block -> body.links.next;
+    (block -> body.links.next) -> body.links.prev = block -> body.links.prev;
+
+    // Neighbours can only be the same block when both of them are the dummy.
+    if (block -> body.links.prev == block -> body.links.next) {
+        CLEAR_LIST_BIT(heap, block -> body.links.prev - heap -> class_heads);
+    }
+
+    size_t block_size = (block -> header^MAGIC) & ~0x6;
+    int list_location = free_list_index(block_size);
+    STAT_SUB(heap, free_list_bytes[list_location], block_size);
+    if (list_location == SF_NUM_CLASSES - 1) {
+        large_index_remove(heap, (sf_large_block*)block);
+    }
+}
+
+/*
+ * Returns 1 if block a comes before block b in the skip list: smaller size first, lower address on equal size.
+ */
+static int large_index_before(sf_large_block* a, sf_large_block* b) {
+    size_t a_size = (a -> header^MAGIC) & ~0x6;
+    size_t b_size = (b -> header^MAGIC) & ~0x6;
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/*
+ * This method adds a block of the last free list to the skip list. Caller must hold that list.
+ */
+void large_index_insert(sf_heap_t* heap, sf_large_block* block) {
+    sf_large_block* update[LARGE_INDEX_LEVELS];     // Last block before the new one, on each level.
+    sf_large_block* current = &heap -> large_index_head;
+
+    for (int level = LARGE_INDEX_LEVELS - 1; level >= 0; level--) {
+        while (current -> forward[level] != NULL && large_index_before(current -> forward[level], block)) {
+            current = current -> forward[level];
+        }
+        update[level] = current;
+    }
+
+    // Pick number of levels, each further level with half the chance of the previous one (xorshift32).
+    heap -> large_index_seed ^= heap -> large_index_seed << 13;
+    heap -> large_index_seed ^= heap -> large_index_seed >> 17;
+    heap -> large_index_seed ^= heap -> large_index_seed << 5;
+    int levels = 1 + __builtin_ctz(heap -> large_index_seed | (1u << (LARGE_INDEX_LEVELS - 1)));
+
+    block -> levels = levels;
+    for (int level = 0; level < levels; level++) {
+        block -> forward[level] = update[level] -> forward[level];
+        update[level] -> forward[level] = block;
+    }
+}
+
+/*
+ * This method takes a block of the last free list out of the skip list. Caller must hold that list.
+ */
+void large_index_remove(sf_heap_t* heap, sf_large_block* block) {
+    sf_large_block* current = &heap -> large_index_head;
+
+    for (int level = LARGE_INDEX_LEVELS - 1; level >= 0; level--) {
+        while (current -> forward[level] != NULL && large_index_before(current -> forward[level], block)) {
+            current = current -> forward[level];
+        }
+        if (level < block -> levels) {
+            current -> forward[level] = block -> forward[level];
+        }
+    }
 }
 
 /*
- * This method adds a new page to the end of the heap.
- * Header adn footer of new page is constructed here.
+ * @return smallest block of the last free list with at least `size` bytes (lowest address among equal sizes),
+ * or NULL if there is none. Block is not removed. Caller must hold the last list.
+ */
+sf_large_block* large_index_best_fit(sf_heap_t* heap, size_t size) {
+    sf_large_block* current = &heap -> large_index_head;
+
+    for (int level = LARGE_INDEX_LEVELS - 1; level >= 0; level--) {
+        while (current -> forward[level] != NULL && ((current -> forward[level] -> header^MAGIC) & ~0x6) < size) {
+            current = current -> forward[level];
+        }
+    }
+    return current -> forward[0];
+}
+
+/*
+ * This method returns the size of the largest free block. The last list gives it exactly through the skip list,
+ * whose last block is the largest. If that list is empty, it is estimated from the highest non empty list:
+ * the size limit of that list, or all of its bytes if they are fewer.
+ */
+size_t largest_free_block(sf_heap_t* heap) {
+    setup_heap();
+    size_t largest = 0;
+
+    SF_HEAP_LOCK(heap);
+    SF_TAGS_SHARED_LOCK(heap);
+    SF_FREE_LIST_LOCK(heap, SF_NUM_CLASSES - 1);
+    sf_large_block* current = &heap -> large_index_head;
+    for (int level = LARGE_INDEX_LEVELS - 1; level >= 0; level--) {
+        while (current -> forward[level] != NULL) {
+            current = current -> forward[level];
+        }
+    }
+    if (current != &heap -> large_index_head) {
+        largest = (current -> header^MAGIC) & ~0x6;
+    }
+    SF_FREE_LIST_UNLOCK(heap, SF_NUM_CLASSES - 1);
+    SF_TAGS_UNLOCK(heap);
+    SF_HEAP_UNLOCK(heap);
+
+    unsigned long lists = LIST_BITMAP(heap) & ~(1ul << (SF_NUM_CLASSES - 1));
+    if (largest == 0 && lists != 0) {
+        int list_location = 63 - __builtin_clzl(lists);
+        largest = STAT_READ(heap, free_list_bytes[list_location]);
+        if (largest > class_limits[list_location]) {
+            largest = class_limits[list_location];
+        }
+    }
+    return largest;
+}
+
+/*
+ * This method returns the index of the free list, that is the size class, that holds blocks of given size.
+ * Counted in rows of 16 bytes, sizes up to 2 * SF_CLASS_STEPS rows map to a class each. A larger size of
+ * `rows` rows lies in (2^bits, 2^(bits+1)] with bits the bit length of (rows - 1) minus 1; that range is split
+ * into SF_CLASS_STEPS classes, and the top bits of (rows - 1) below the leading one tell which of them.
+ * A count-leading-zeros and a shift instead of searching class_limits.
+ */
+int free_list_index(size_t size) {
+    size_t rows = size / 16;
+    int list_location;
+
+    if (rows <= 2 * SF_CLASS_STEPS) {
+        list_location = rows - 2;
+    }
+    else {
+        int shift = (63 - __builtin_clzl(rows - 1)) - CLASS_STEPS_BITS;   // Bits of (rows - 1) below the class bits.
+        list_location = SF_CLASS_STEPS * shift - 1 + ((rows - 1) >> shift);
+    }
+
+    if(list_location > SF_NUM_CLASSES - 1){	// If size is too large, it goes to last list.
+        list_location = SF_NUM_CLASSES - 1;
+    }
+    return list_location;
+}
+
+/*
+ * This method adds a page to the end of a heap. The default heap gets it from sf_mem_grow(), a created heap
+ * takes the next page of its mapping.
+ *
+ * @return start of the new page, or NULL if the heap cannot grow any further.
+ */
+static void* heap_page(sf_heap_t* heap) {
+    if (heap -> mem_limit == NULL) {
+        return sf_mem_grow();
+    }
+    if (heap -> mem_end == heap -> mem_limit) {
+        return NULL;
+    }
+    void* page = heap -> mem_end;
+#ifdef SF_HUGE_PAGES
+    if (((size_t)page & (SF_HUGE_EXTENT - 1)) == 0) {      // First page of an extent.
+        huge_extent_advise(page, heap -> mem_limit);
+    }
+#endif
+    __atomic_store_n(&heap -> mem_end, heap -> mem_end + PAGE_SZ, __ATOMIC_RELEASE);   // Read without the lock.
+    return page;
+}
+
+void* heap_start(sf_heap_t* heap) {
+    return heap -> mem_limit == NULL ? sf_mem_start() : heap -> mem_start;
+}
+
+void* heap_end(sf_heap_t* heap) {
+    return heap -> mem_limit == NULL ? sf_mem_end() : __atomic_load_n(&heap -> mem_end, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * This method adds `pages` new pages to the end of the heap, as a single free block.
+ * Header adn footer of new block is constructed here, and it is coalesced with the last block if that is free.
  * 8 bytes reserved paddings are alos set here.
  *
- * @return -1 if unsuccessful, 1 otherwise
+ * @return -1 if not even one page could be added, 1 otherwise. Pages added before heap_page() fails are kept.
  */
-int mem_grow() {
+int mem_grow(sf_heap_t* heap, size_t pages) {
     size_t page_size = PAGE_SZ; 				// Every new page will have 8 bytes padding cutoff.
 
     // If this page is the first page added to heap,
-    if(first_page_flag) {
+    if(heap -> first_page_flag) {
         page_size -= 16;                     		// If this page is the first page that is added to heap, we need to reserve 16 bytes for header and footer padding.
-        sf_header* new_page_ptr = sf_mem_grow();	// Add new page to heap. Save its starting address.
+        sf_header* new_page_ptr = heap_page(heap);	// Add new page to heap. Save its starting address.
 
-        if(new_page_ptr == NULL){   // if sf_mem_grow() returns NULL, return -1
+        if(new_page_ptr == NULL){   // if heap_page() returns NULL, return -1
     		return -1;
     	}
+        heap -> first_page_flag = 0;
 
     	// Last 8 bytes of allocated page will be 8 bytes padding.
-        sf_footer* reserved_footer = sf_mem_end();
+        sf_footer* reserved_footer = heap_end(heap);
         reserved_footer--;
 
         // these are going to be 8 bytes paddings, set this block alloc. bit to prevent coalescing.
@@ -417,68 +1175,210 @@ int mem_grow() {
         *new_page_ptr = ((page_size) + PREV_BLOCK_ALLOCATED)^MAGIC;		// size of the page +  prev. alloc. bit set.
 
         // Now add this consturcted page to free list.
-        add_to_free_list(new_page_header);
+        add_to_free_list(heap, new_page_header);
+        add_clean_pages(heap, new_page_header);
+
+        // Rest of the pages are added after this one, like on any later growth, which then counts the growth.
+        if (--pages == 0 || mem_grow(heap, pages) == -1) {
+            STAT_ADD(heap, heap_grows, 1);
+        }
         return 1;
     }
 
-    // There exist some other pages in hte heap. Check previous footer to get more info about last mem block.
-    else {
-    	sf_footer* reserved_footer = sf_mem_end();						// Save the 8 bytes padding at the end.
-    	reserved_footer--;
-    	sf_header* new_page_header = reserved_footer;					// New page header will be added to 8 Byte padding area of last page.
-
-    	// If previous block is allocated, No need for coalesing
-    	if( ((*reserved_footer^MAGIC) & PREV_BLOCK_ALLOCATED) == PREV_BLOCK_ALLOCATED) {
-    		new_page_header = sf_mem_grow();							// Add new page to heap.
-
-    		if(new_page_header == NULL){
-    			return -1;
-    		}
-
-            new_page_header--;
-    		// Go to last row of newly added page, and set 8 bytes padding to here.
-    		reserved_footer = sf_mem_end();
-    		reserved_footer--;
-    		*reserved_footer = (THIS_BLOCK_ALLOCATED^MAGIC);			// Set 8 byte padding to be alloc. to prevent coalescing.
-
-    		// Now, construct header and footer for this newly created page.
-    		sf_header* page_pointer = new_page_header;
-    		sf_footer* new_page_footer = page_pointer + (page_size/8 -1);
-    		*new_page_header = (page_size + PREV_BLOCK_ALLOCATED)^MAGIC;
-    		*new_page_footer = (page_size + PREV_BLOCK_ALLOCATED)^MAGIC;
-
-    		// Now add this newly created page to free list.
-    		add_to_free_list(new_page_header);
-
-    		return 1;
-    	}
-    	// Previous block is free, we need to perform coalescing.
-    	else {
-    		// sf_mem_grow creates a new page in the heap. We need to go back a row, overwrite the padding from previous block, then
-    		// add a padding to end of this block.
-    		new_page_header = sf_mem_grow();
+    // There exist some other pages in hte heap. New block starts at the 8 bytes padding of the last page,
+    // which also tells whether the last block is allocated.
+    sf_header* new_block_header = (sf_header*)heap_end(heap) - 1;
+    size_t pages_added = 0;
+    while (pages_added < pages && heap_page(heap) != NULL) {	// Pages come one per call.
+        pages_added++;
+    }
+    if (pages_added == 0) {
+        return -1;
+    }
+    STAT_ADD(heap, heap_grows, 1);
+
+    // Go to last row of newly added pages, and set 8 bytes padding to here.
+    sf_footer* reserved_footer = heap_end(heap);
+    reserved_footer--;
+    *reserved_footer = (THIS_BLOCK_ALLOCATED^MAGIC);			// Set 8 byte padding to be alloc. to prevent coalescing.
+
+    // Now, construct header and footer for the new block. Prev. alloc. bit is carried over from the old padding.
+    size_t block_size = pages_added * page_size;
+    *new_block_header = (((*new_block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | block_size)^MAGIC;
+    sf_footer* new_block_footer = new_block_header + (block_size/8 - 1);
+    *new_block_footer = *new_block_header;
+
+    // If previous block is free, this merges the two.
+    sf_header* merged_header = coalescing(heap, new_block_header);
+    add_to_free_list(heap, merged_header);
+    add_clean_pages(heap, new_block_header);
+    return 1;
+}
 
-			if(new_page_header == NULL){
-    			return -1;
-    		}
-            new_page_header--;
+/*
+ * This method records the pages just added to the heap as clean, `new_block_header` being the header that was
+ * written at their start. Clean bytes are kept in one range: if the range already ran up to the end of the old
+ * heap, it grows over the new pages, otherwise the new pages replace it when they are larger.
+ */
+void add_clean_pages(sf_heap_t* heap, sf_header* new_block_header) {
+#ifdef SF_MEM_GROW_ZEROED
+    char* tail_footer = (char*)((sf_footer*)heap_end(heap) - 2);
+
+    if (heap -> clean_start < heap -> clean_end && heap -> clean_end == (char*)(new_block_header - 1)) {
+        // Last block was free and took the new pages in. Its old footer and the header written on the old
+        // padding are now in the middle of the block, clear them so the range stays zero.
+        *(new_block_header - 1) = 0;
+        *new_block_header = 0;
+        heap -> clean_end = tail_footer;
+    }
+    else if ((size_t)(tail_footer - ((char*)(new_block_header - 1) + sizeof(sf_large_block))) > (size_t)(heap -> clean_end - heap -> clean_start)) {
+        heap -> clean_start = (char*)(new_block_header - 1) + sizeof(sf_large_block);    // Links and skip list fields come first.
+        heap -> clean_end = tail_footer;
+    }
+#endif
+}
 
+/*
+ * This method takes the bytes from `tags_start` up to `tags_end` out of the range from *range_start up to
+ * *range_end, keeping the larger side.
+ */
+static void cut_range(char** range_start, char** range_end, char* tags_start, char* tags_end) {
+    char* low = __atomic_load_n(range_start, __ATOMIC_RELAXED);
+    char* high = __atomic_load_n(range_end, __ATOMIC_RELAXED);
+    if (tags_end <= low || tags_start >= high) {
+        return;
+    }
 
-    		reserved_footer = sf_mem_end();
-    		reserved_footer--;
-    		*reserved_footer = (THIS_BLOCK_ALLOCATED^MAGIC);
+    size_t below = tags_start > low ? tags_start - low : 0;
+    size_t above = high > tags_end ? high - tags_end : 0;
+    if (below >= above) {
+        high = low + below;
+    }
+    else {
+        low = tags_end;
+    }
+    __atomic_store_n(range_start, low, __ATOMIC_RELAXED);
+    __atomic_store_n(range_end, high, __ATOMIC_RELAXED);
+}
 
-    		sf_header* free_block_ptr = new_page_header;
-    		*new_page_header = (page_size^MAGIC);						// Update header of new page.
+/*
+ * This method is called whenever the bytes of a free block from `start` up to `end` become an allocated block.
+ * Caller writes boundary tags right next to them: the footer of a free block before `start`, or the header and
+ * links of a free block at `end`. Both are taken out of the clean range together with the block, keeping the
+ * larger side, and the part of the block that was clean is left in claimed_start/claimed_end. Released pages
+ * are faulted in again once written, so they leave the released ranges the same way.
+ * Each range lies inside one free block and only the caller can reach that block, others just read it.
+ */
+void claim_clean(sf_heap_t* heap, sf_header* start, sf_header* end) {
+    char* tags_start = (char*)(start - 1);
+    char* tags_end = (char*)(end - 1) + sizeof(sf_large_block);
+    for (int i = 0; i < RELEASED_RANGES; i++) {
+        cut_range(&heap -> released[i].start, &heap -> released[i].end, tags_start, tags_end);
+    }
 
-    		sf_header* free_block_footer = free_block_ptr + (page_size/8 -1);
-    		*free_block_footer = (page_size^MAGIC);						// Update footer of new page.
+    char* low = __atomic_load_n(&heap -> clean_start, __ATOMIC_RELAXED);
+    char* high = __atomic_load_n(&heap -> clean_end, __ATOMIC_RELAXED);
+    if (tags_end <= low || tags_start >= high) {
+        return;
+    }
+    claimed_start = (char*)start > low ? (char*)start : low;
+    claimed_end = (char*)end < high ? (char*)end : high;
+    cut_range(&heap -> clean_start, &heap -> clean_end, tags_start, tags_end);
+}
 
-    		new_page_header = coalescing(new_page_header);				// Perform coalescing on this block.
-    		add_to_free_list(new_page_header);
-    		return 1;
-    	}
+/*
+ * This method gives `pages` pages at the end of the heap back, out of the free block at the end of the heap,
+ * which must be larger than that. Only the default heap can be lowered, and only where sf_mem_shrink() is
+ * provided; lib/sfutil.o does not, its heap only grows. Created heaps keep their pages until destroyed.
+ * With striped locks, caller must hold the tags lock exclusively.
+ *
+ * @return 1 if the heap was lowered, -1 if it could not be.
+ */
+int mem_shrink(sf_heap_t* heap, size_t pages) {
+    if (heap -> mem_limit != NULL || sf_mem_shrink == NULL) {
+        return -1;
+    }
+    sf_footer* tail_footer = (sf_footer*)heap_end(heap) - 2;
+    size_t tail_size = (*tail_footer^MAGIC) & ~0x6;
+    sf_header* tail_header = tail_footer - (tail_size/8 - 1);
+
+    remove_from_free_list(heap, (sf_block*)(tail_header - 1));
+    if (sf_mem_shrink(pages) != 0) {
+        add_to_free_list(heap, tail_header);
+        return -1;
     }
+    tail_size -= pages * PAGE_SZ;
+    *tail_header = (((*tail_header^MAGIC) & PREV_BLOCK_ALLOCATED) | tail_size)^MAGIC;
+    *(tail_header + tail_size/8 - 1) = *tail_header;
+    *((sf_footer*)heap_end(heap) - 1) = THIS_BLOCK_ALLOCATED^MAGIC;     // Padding moves down, block before it is free.
+    add_to_free_list(heap, tail_header);
+
+    // Clean range ends at the footer at the latest, the pages past the new one are gone.
+    char* new_footer = (char*)((sf_footer*)heap_end(heap) - 2);
+    if (heap -> clean_end > new_footer) {
+        heap -> clean_end = heap -> clean_start < new_footer ? new_footer : heap -> clean_start;
+    }
+    return 1;
+}
+
+/*
+ * This method grows the heap by just enough pages for a block of `size` bytes, counting the free block already
+ * at the end of the heap, and cuts the block directly from the start of that last free block. Anything left goes
+ * back to a free list and stays at the end of the heap, so the next growth extends it again.
+ * With striped locks, caller must hold the tags lock exclusively.
+ *
+ * @return allocated block, or NULL if heap could not grow enough.
+ */
+sf_block* grow_and_carve(sf_heap_t* heap, size_t size) {
+    size_t pages;
+    if (heap -> first_page_flag) {
+        // First page loses 16 bytes to the paddings at both ends of the heap.
+        pages = 1;
+        if (size > PAGE_SZ - 16) {
+            pages += (size - (PAGE_SZ - 16) + PAGE_SZ - 1) / PAGE_SZ;
+        }
+    }
+    else {
+        sf_footer* reserved_footer = (sf_footer*)heap_end(heap) - 1;
+        size_t tail_size = 0;       // Size of the free block at the end of the heap, if there is one.
+        if (((*reserved_footer^MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
+            tail_size = (*(reserved_footer - 1)^MAGIC) & ~0x6;
+        }
+        pages = size > tail_size ? (size - tail_size + PAGE_SZ - 1) / PAGE_SZ : 0;
+    }
+    if (pages > 0 && mem_grow(heap, pages) == -1) {
+        return NULL;
+    }
+
+    // Last block is free now, unless growth failed half way without being able to fit it.
+    sf_footer* reserved_footer = (sf_footer*)heap_end(heap) - 1;
+    if (((*reserved_footer^MAGIC) & PREV_BLOCK_ALLOCATED) != 0) {
+        return NULL;
+    }
+    sf_footer* tail_footer = reserved_footer - 1;
+    size_t tail_size = (*tail_footer^MAGIC) & ~0x6;
+    if (tail_size < size) {
+        return NULL;
+    }
+    sf_header* block_header = tail_footer - (tail_size/8 - 1);
+    remove_from_free_list(heap, (sf_block*)(block_header - 1));
+
+    if (tail_size - size >= 32) {
+        // Block at the start, rest stays free at the end. Padding already has its prev. alloc. bit cleared.
+        sf_header* rest_header = block_header + size/8;
+        *rest_header = ((tail_size - size) | PREV_BLOCK_ALLOCATED)^MAGIC;
+        *tail_footer = *rest_header;
+        *block_header = (((*block_header^MAGIC) & PREV_BLOCK_ALLOCATED) | size | THIS_BLOCK_ALLOCATED)^MAGIC;
+        add_to_free_list(heap, rest_header);
+        claim_clean(heap, block_header, rest_header);
+    }
+    else {
+        // Rest would be a splinter, take the whole block.
+        *block_header = ((*block_header^MAGIC) | THIS_BLOCK_ALLOCATED)^MAGIC;
+        *reserved_footer = ((*reserved_footer^MAGIC) | PREV_BLOCK_ALLOCATED)^MAGIC;
+        claim_clean(heap, block_header, reserved_footer);
+    }
+    return (sf_block*)(block_header - 1);
 }
 
 int belongs_to_quick_list(double size) {
@@ -488,98 +1388,215 @@ int belongs_to_quick_list(double size) {
         return 0;
 }
 
-void add_to_quick_list(sf_header* block_ptr) {
+void add_to_quick_list(sf_heap_t* heap, sf_header* block_ptr) {
     size_t block_size = ((*block_ptr^MAGIC) & ~0x6);			// Get the block size
     int list_location = ( block_size - 32 )/16;
 
-    check_flush(list_location);                         	// Perform flushing in list location, if required.
+    SF_QUICK_LIST_LOCK(heap, list_location);
+    check_flush(heap, list_location);                         	// Perform flushing in list location, if required.
     sf_block* block_to_add = (sf_block*)--block_ptr;    	// Construct a block pointer with this header.
 
-    if(sf_quick_lists[list_location].length != 0) {
-        block_to_add -> body.links.next = sf_quick_lists[list_location].first; // Next field filled in memory.
+    if(heap -> quick_lists[list_location].length != 0) {
+        block_to_add -> body.links.next = heap -> quick_lists[list_location].first; // Next field filled in memory.
     }
     else {
     	block_to_add -> body.links.next = NULL;
     }
 
-    sf_quick_lists[list_location].first = block_to_add;    // Add created block struct to quick list.
-    sf_quick_lists[list_location].length++;                // Increment such bin's length.
+    heap -> quick_lists[list_location].first = block_to_add;    // Add created block struct to quick list.
+    heap -> quick_lists[list_location].length++;                // Increment such bin's length.
+    STAT_ADD(heap, quick_list_bytes, block_size);
+    SF_QUICK_LIST_UNLOCK(heap, list_location);
 }
 /*
- *	This method performs flushing on quick list specific location.
+ *	This method performs flushing on quick list specific location. Caller holds the quick list's lock.
+ *	Only the oldest half of a full list is flushed: blocks that were freed last are the likeliest to be
+ *	asked for again, and keeping them breaks the flush and refill cycle of bursty workloads.
  */
-void check_flush(int list_location) {
+void check_flush(sf_heap_t* heap, int list_location) {
     sf_block* current_block;
     sf_header *block_ptr;
+    int length = heap -> quick_lists[list_location].length;
 
     // if we dont have enough space in this bin, flush it. Otherwise, do nothing.
-    if(sf_quick_lists[list_location].length == 5) {
-        for (int i = 0; i < 5; i++) {
-            sf_quick_lists[list_location].length--;
-            current_block = sf_quick_lists[list_location].first;  	// get the current block from the bin.
-            // Remove the top block from quick list.
-            sf_quick_lists[list_location].first = sf_quick_lists[list_location].first -> body.links.next;
+    if(length >= heap -> quick_list_states[list_location].capacity) {
+        int flush_count = length / 2;
+        if (length - flush_count >= heap -> quick_list_states[list_location].capacity) {    // Capacity was lowered since.
+            flush_count = length - heap -> quick_list_states[list_location].capacity + 1;
+        }
+
+        // Oldest blocks are at the end of the list. Cut the list right after the ones we keep.
+        sf_block* last_kept = heap -> quick_lists[list_location].first;
+        for (int i = 1; i < length - flush_count; i++) {
+            last_kept = last_kept -> body.links.next;
+        }
+        current_block = last_kept -> body.links.next;
+        last_kept -> body.links.next = NULL;
+        heap -> quick_lists[list_location].length -= flush_count;
+        heap -> quick_list_states[list_location].flushes++;
+
+        SF_TAGS_EXCLUSIVE_LOCK(heap);
+        STAT_ADD(heap, quick_list_flushes, 1);
+        for (int i = 0; i < flush_count; i++) {
+            sf_block* next_block = current_block -> body.links.next;
            	block_ptr = &(current_block->header);					        // set block ptr header to header field of block to be coalesced.
             size_t block_size = (*block_ptr^MAGIC) & ~0x6;
+            STAT_SUB(heap, quick_list_bytes, block_size);
             *block_ptr = ((*block_ptr^MAGIC) & ~THIS_BLOCK_ALLOCATED)^MAGIC;
             sf_header* block_header = block_ptr;
             block_ptr += (block_size)/8 -1;
             *block_ptr = (*block_header^MAGIC)^MAGIC;
-            block_header = coalescing(block_header);              					        // Perform coalescing with proper blocks.
-            add_to_free_list(block_header);                                 // Add this block to free list.
+            block_header = coalescing(heap, block_header);              					        // Perform coalescing with proper blocks.
+            add_to_free_list(heap, block_header);                                 // Add this block to free list.
+            current_block = next_block;
         }
+        SF_TAGS_UNLOCK(heap);
     }
 }
 
-int is_valid_header(void* ptr) {
-	if (ptr == NULL) {
+/*
+ * This method takes `bytes` of the quick list budget, or gives them back if negative.
+ *
+ * @return 1 if taken, 0 if that would go over the budget.
+ */
+static int reserve_quick_budget(sf_heap_t* heap, long bytes) {
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+    // Lists adapt under their own locks, so the shared total is updated atomically.
+    if (__atomic_add_fetch(&heap -> quick_list_budget_used, bytes, __ATOMIC_RELAXED) > SF_QUICK_LIST_BUDGET && bytes > 0) {
+        __atomic_sub_fetch(&heap -> quick_list_budget_used, bytes, __ATOMIC_RELAXED);
         return 0;
     }
-    ptr = ptr - 8;
-    // Check if pointer is 16 byte alligned
-    if ((((*(sf_header*)ptr)^MAGIC) & (0x9)) != 0) {
+#else
+    if (heap -> quick_list_budget_used + bytes > SF_QUICK_LIST_BUDGET && bytes > 0) {
         return 0;
     }
-    // Check value of header
-    else {
-        sf_header* header = (sf_header*)ptr;
-        size_t header_size = (*header^MAGIC) & ~0x6;
-        sf_footer* footer = (header + header_size/8 - 1);
-        sf_header* mem_start = sf_mem_start();
-        mem_start++;
-        sf_footer* mem_end = sf_mem_end();
-        mem_end--;
+    heap -> quick_list_budget_used += bytes;
+#endif
+    return 1;
+}
 
-        if(header_size < 32) {
-            return 0;
-        }
-        if(header_size % 16 != 0) {
-            return 0;
+/*
+ * This method counts a request to a quick list and, once per QUICK_EPOCH requests, resizes the list.
+ * A list that missed after flushing blocks was too short for the bursts it sees, it grows by half.
+ * A list that never missed while some of its blocks sat unused the whole epoch, or that rarely hits at all,
+ * shrinks by one block and leaves that part of the budget to other sizes. Caller holds the list's lock.
+ */
+static void adapt_quick_list(sf_heap_t* heap, int list_location, int hit) {
+    struct quick_list_state* state = &heap -> quick_list_states[list_location];
+    int length = heap -> quick_lists[list_location].length;
+    long block_size = 32 + 16 * list_location;
+
+    state -> requests++;
+    state -> hits += hit;
+    if (length < state -> low_water) {
+        state -> low_water = length;
+    }
+    if (state -> requests < QUICK_EPOCH) {
+        return;
+    }
+
+    int misses = state -> requests - state -> hits;
+    if (misses > 0 && state -> flushes > 0) {
+        int grow = state -> capacity / 2;
+        if (state -> capacity + grow > QUICK_LIST_LIMIT) {
+            grow = QUICK_LIST_LIMIT - state -> capacity;
         }
-        if((header < mem_start) && ((footer >= mem_end))) {
-            return 0;
+        if (grow > 0 && reserve_quick_budget(heap, grow * block_size)) {
+            state -> capacity += grow;
         }
-        // If this block is not allocated, reject.
-        if(((*header^MAGIC) & THIS_BLOCK_ALLOCATED) == 0) {
-            return 0;
+    }
+    else if (((misses == 0 && state -> low_water > 0) || state -> hits * 4 < state -> requests)
+             && state -> capacity > QUICK_LIST_MIN) {
+        state -> capacity--;
+        reserve_quick_budget(heap, -block_size);
+    }
+    state -> requests = 0;
+    state -> hits = 0;
+    state -> flushes = 0;
+    state -> low_water = length;
+}
+
+/*
+ * This method validates a pointer passed to sf_free() or sf_realloc(). With striped locks, it takes the
+ * tags lock itself, so caller must not hold it.
+ */
+int is_valid_header(sf_heap_t* heap, void* ptr) {
+    if (!is_valid_block(heap, ptr)) {
+        return 0;
+    }
+    else {
+        int valid = 1;
+        sf_header* header = (sf_header*)(ptr - 8);
+        if (IS_MMAPPED(header)) {           // Huge blocks have no neighbours to check.
+            return 1;
         }
+        SF_TAGS_SHARED_LOCK(heap);
         // IF prev block seems to be free and,
         if (((*header^MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
-            sf_footer* prev_footer = --header;
+            sf_footer* prev_footer = header - 1;
             // if previous block is not free, reject
             if (((*prev_footer^MAGIC) & THIS_BLOCK_ALLOCATED) != 0) {
-                return 0;
+                valid = 0;
             }
             // If previous footer says this block is free, and
             else {
-                sf_header* prev_header = prev_footer - ((*prev_footer^MAGIC)/8 -1);
-                // If header of previous block doesn't match footer of previous block, reject
-                if ((*prev_header^MAGIC) != (*prev_footer^MAGIC)) {
-                    return 0;
+                // An allocation in its free list may hand the previous block out right now, so hold that list
+                // and check again that it is still free before looking at its header.
+                int list_location = free_list_index((*prev_footer^MAGIC) & ~0x6);
+                SF_FREE_LIST_LOCK(heap, list_location);
+                if (((*header^MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
+                    sf_header* prev_header = prev_footer - ((*prev_footer^MAGIC)/8 -1);
+                    // If header of previous block doesn't match footer of previous block, reject
+                    if ((*prev_header^MAGIC) != (*prev_footer^MAGIC)) {
+                        valid = 0;
+                    }
                 }
+                SF_FREE_LIST_UNLOCK(heap, list_location);
             }
         }
-        // Valid header.
-        return 1;
+        SF_TAGS_UNLOCK(heap);
+        return valid;
+    }
+}
+
+/*
+ * This method performs the checks of is_valid_header() that only look at the block's own header.
+ * It never reads a neighbouring block, so it is safe to call without holding the heap lock.
+ */
+int is_valid_block(sf_heap_t* heap, void* ptr) {
+	if (ptr == NULL) {
+        return 0;
+    }
+    ptr = ptr - 8;
+    // Huge blocks live outside of the heap, they are checked against their mapping. Only the default heap has them.
+    if (IS_MMAPPED((sf_header*)ptr)) {
+        return heap == &sf_default_heap && is_valid_mmapped_block(ptr);
+    }
+    // Check if pointer is 16 byte alligned
+    if ((((*(sf_header*)ptr)^MAGIC) & (0x9)) != 0) {
+        return 0;
+    }
+    // Check value of header
+    sf_header* header = (sf_header*)ptr;
+    size_t header_size = (*header^MAGIC) & ~0x6;
+    sf_footer* footer = (header + header_size/8 - 1);
+    sf_header* mem_start = heap_start(heap);
+    mem_start++;
+    sf_footer* mem_end = heap_end(heap);
+    mem_end--;
+
+    if(header_size < 32) {
+        return 0;
+    }
+    if(header_size % 16 != 0) {
+        return 0;
+    }
+    if((header < mem_start) || ((footer >= mem_end))) {	// Block must lie inside this heap.
+        return 0;
+    }
+    // If this block is not allocated, reject.
+    if(((*header^MAGIC) & THIS_BLOCK_ALLOCATED) == 0) {
+        return 0;
     }
+    return 1;
 }
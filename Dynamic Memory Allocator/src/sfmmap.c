@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "errno.h"
+
+/*
+ * Huge blocks: requests of SF_MMAP_THRESHOLD bytes or more get an anonymous mapping of their own instead of a
+ * piece of the heap, so they never fragment the heap and their memory goes back to the OS as soon as they
+ * are freed. Mapping looks like a one block heap:
+ *
+ *   +---------+--------------------------------------------------+
+ *   | unused  | header |          payload ...                    |
+ *   +---------+--------------------------------------------------+
+ *   ^ mapping start      ^ mapping start + 16, 16 byte aligned
+ *
+ * Header holds the length of the whole mapping as its size, with MMAPPED_BLOCK, THIS_BLOCK_ALLOCATED and
+ * PREV_BLOCK_ALLOCATED set, so nothing ever looks for a neighbouring block. These blocks touch no list and
+ * no boundary tag of the heap, so none of the functions here needs the heap lock.
+ */
+
+/*
+ * @return length of the mapping needed for a block of `size` bytes, header included.
+ */
+static size_t mapping_length(size_t size) {
+    size += 8;                                          // Unused row in front of the header.
+    return (size + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+}
+
+/*
+ * This method maps a new huge block.
+ *
+ * @param size Block size, header included, already rounded to 16 bytes.
+ * @return allocated block, or NULL if the mapping failed.
+ */
+sf_block* mmap_block(size_t size) {
+    size_t length = mapping_length(size);
+    if (length < size) {                                // Size was so large that rounding wrapped around.
+        return NULL;
+    }
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    sf_block* block = mapping;
+    block -> header = (length | MMAPPED_BLOCK | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)^MAGIC;
+    STAT_ADD(&sf_default_heap, mapped_bytes, length);
+    stats_note_peak(&sf_default_heap);
+    return block;
+}
+
+/*
+ * This method unmaps a huge block. Header must already be validated.
+ */
+void munmap_block(sf_header* block_header) {
+    STAT_SUB(&sf_default_heap, mapped_bytes, (*block_header^MAGIC) & ~0x7);
+    munmap(block_header - 1, (*block_header^MAGIC) & ~0x7);
+}
+
+/*
+ * This method resizes a huge block to hold a block of `size` bytes. Kernel moves the pages if it has to,
+ * the payload is never copied by us.
+ *
+ * @return resized block, possibly at a new address, or NULL if it could not be resized. In that case
+ * the block is unchanged.
+ */
+sf_block* mremap_block(sf_header* block_header, size_t size) {
+    size_t old_length = (*block_header^MAGIC) & ~0x7;
+    size_t new_length = mapping_length(size);
+    if (new_length < size) {
+        return NULL;
+    }
+    if (new_length == old_length) {
+        return (sf_block*)(block_header - 1);
+    }
+
+    void* mapping = mremap(block_header - 1, old_length, new_length, MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    sf_block* block = mapping;
+    block -> header = (new_length | MMAPPED_BLOCK | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)^MAGIC;
+    STAT_ADD(&sf_default_heap, mapped_bytes, new_length - old_length);       // Wraps around to a subtraction when shrinking.
+    stats_note_peak(&sf_default_heap);
+    return block;
+}
+
+/*
+ * This method performs the checks of is_valid_block() for a header with MMAPPED_BLOCK set.
+ * Mappings are page aligned, so the header must sit 8 bytes into a page and cover whole pages.
+ */
+int is_valid_mmapped_block(sf_header* block_header) {
+    size_t header_value = *block_header^MAGIC;
+    size_t length = header_value & ~0x7;
+
+    if (((size_t)block_header & (PAGE_SZ - 1)) != 8) {
+        return 0;
+    }
+    if (length < PAGE_SZ || length % PAGE_SZ != 0) {
+        return 0;
+    }
+    if ((header_value & (THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)) != (THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED)) {
+        return 0;
+    }
+    return 1;
+}
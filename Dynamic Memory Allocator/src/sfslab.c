@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Slabs: a slab hands out objects of one size from chunks of SLAB_CHUNK_SIZE bytes, each aligned to its own size.
+ * Chunks are taken from the heap SLAB_RUN_CHUNKS at a time, as one run from sf_memalign(), so the block header,
+ * the alignment slack and the larger request sf_memalign() makes are paid once per run. Objects carry no header;
+ * the chunk an object belongs to is found by masking the object's address, and a bitmap at the start of the chunk
+ * tells which objects are free. A chunk looks like:
+ *
+ *   +-------------+-----------------+---------+---------+-----+---------+
+ *   | chunk links | free bitmap ... | padding | object0 | ... | objectN |
+ *   +-------------+-----------------+---------+---------+-----+---------+
+ *   ^ SLAB_CHUNK_SIZE aligned                   ^ aligned to slab's alignment
+ *
+ * Chunks with at least one free object are on the slab's partial list, full ones on its full list. A run goes
+ * back to the heap once none of its chunks has an object in use.
+ * A slab must not be used by several threads at the same time.
+ */
+
+#define SLAB_CHUNK_SIZE PAGE_SZ
+#define SLAB_RUN_CHUNKS 4
+
+typedef struct sf_slab_chunk {
+    struct sf_slab* slab;               // Slab this chunk belongs to, checked on free.
+    struct sf_slab_chunk* next;         // Neighbours in the partial or the full list.
+    struct sf_slab_chunk* prev;
+    struct sf_slab_chunk* run;          // First chunk of the run, the block taken from the heap.
+    size_t empty_chunks;                // First chunk only: chunks of the run with no object in use.
+    size_t free_count;                  // Number of free objects in this chunk.
+    uint64_t free_bitmap[];             // Bit i is set while object i is free.
+} sf_slab_chunk;
+
+struct sf_slab {
+    size_t object_size;                 // Distance between two objects, a multiple of the alignment.
+    size_t objects_per_chunk;
+    size_t first_object;                // Offset of object 0 from the start of its chunk.
+    sf_slab_chunk* partial;             // Chunks with free objects, allocations come from the first one.
+    sf_slab_chunk* full;                // Chunks without free objects.
+    size_t partial_count;               // Number of chunks on the partial list.
+};
+
+/*
+ * This method unlinks a chunk from the list starting at `list`.
+ */
+static void chunk_unlink(sf_slab_chunk** list, sf_slab_chunk* chunk) {
+    if (chunk -> prev != NULL) {
+        chunk -> prev -> next = chunk -> next;
+    }
+    else {
+        *list = chunk -> next;
+    }
+    if (chunk -> next != NULL) {
+        chunk -> next -> prev = chunk -> prev;
+    }
+}
+
+/*
+ * This method puts a chunk at the front of the list starting at `list`.
+ */
+static void chunk_push(sf_slab_chunk** list, sf_slab_chunk* chunk) {
+    chunk -> prev = NULL;
+    chunk -> next = *list;
+    if (*list != NULL) {
+        (*list) -> prev = chunk;
+    }
+    *list = chunk;
+}
+
+/*
+ * @return offset of the first object in a chunk holding `count` objects aligned to `align`.
+ */
+static size_t first_object_offset(size_t count, size_t align) {
+    size_t header_size = sizeof(sf_slab_chunk) + ((count + 63) / 64) * sizeof(uint64_t);
+    return (header_size + align - 1) & ~(align - 1);
+}
+
+/*
+ * This method takes a new run of chunks from the heap, with every object free, and puts its chunks on the
+ * partial list, first chunk in front.
+ *
+ * @return the first chunk of the run, or NULL if the heap is out of memory.
+ */
+static sf_slab_chunk* run_create(sf_slab* slab) {
+    char* run = sf_memalign(SLAB_RUN_CHUNKS * SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    if (run == NULL) {
+        return NULL;
+    }
+
+    size_t words = (slab -> objects_per_chunk + 63) / 64;
+    for (int index = SLAB_RUN_CHUNKS - 1; index >= 0; index--) {
+        sf_slab_chunk* chunk = (sf_slab_chunk*)(run + index * SLAB_CHUNK_SIZE);
+        chunk -> slab = slab;
+        chunk -> run = (sf_slab_chunk*)run;
+        chunk -> free_count = slab -> objects_per_chunk;
+        for (size_t word = 0; word < words; word++) {
+            chunk -> free_bitmap[word] = ~(uint64_t)0;
+        }
+        if (slab -> objects_per_chunk % 64 != 0) {    // Bits past the last object are never free.
+            chunk -> free_bitmap[words - 1] = ((uint64_t)1 << (slab -> objects_per_chunk % 64)) - 1;
+        }
+        chunk_push(&slab -> partial, chunk);
+    }
+    ((sf_slab_chunk*)run) -> empty_chunks = SLAB_RUN_CHUNKS;
+    slab -> partial_count += SLAB_RUN_CHUNKS;
+    return (sf_slab_chunk*)run;
+}
+
+/*
+ * This method gives a run back to the heap. All of its chunks must be empty, so they are on the partial list.
+ */
+static void run_release(sf_slab* slab, sf_slab_chunk* run) {
+    for (int index = 0; index < SLAB_RUN_CHUNKS; index++) {
+        sf_slab_chunk* chunk = (sf_slab_chunk*)((char*)run + index * SLAB_CHUNK_SIZE);
+        chunk_unlink(&slab -> partial, chunk);
+        chunk -> slab = NULL;
+    }
+    slab -> partial_count -= SLAB_RUN_CHUNKS;
+    sf_free(run);
+}
+
+sf_slab* sf_slab_create(size_t obj_size, size_t align) {
+    if (align == 0) {
+        align = 16;
+    }
+    if (obj_size == 0 || (align & (align - 1)) != 0 || align > SLAB_CHUNK_SIZE / 2) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    size_t object_size = (obj_size + align - 1) & ~(align - 1);
+
+    // Start with as many objects as would fit without any chunk header, and drop objects until the
+    // header and its bitmap fit in front of them.
+    size_t count = SLAB_CHUNK_SIZE / object_size;
+    while (count > 0 && first_object_offset(count, align) + count * object_size > SLAB_CHUNK_SIZE) {
+        count--;
+    }
+    if (count == 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    sf_slab* slab = sf_malloc(sizeof(sf_slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab -> object_size = object_size;
+    slab -> objects_per_chunk = count;
+    slab -> first_object = first_object_offset(count, align);
+    slab -> partial = NULL;
+    slab -> full = NULL;
+    slab -> partial_count = 0;
+    return slab;
+}
+
+void* sf_slab_alloc(sf_slab* slab) {
+    sf_slab_chunk* chunk = slab -> partial;
+    if (chunk == NULL) {
+        chunk = run_create(slab);
+        if (chunk == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    // Partial chunk has a set bit somewhere, take the lowest one.
+    size_t word = 0;
+    while (chunk -> free_bitmap[word] == 0) {
+        word++;
+    }
+    size_t bit = __builtin_ctzll(chunk -> free_bitmap[word]);
+    chunk -> free_bitmap[word] &= chunk -> free_bitmap[word] - 1;
+
+    if (chunk -> free_count-- == slab -> objects_per_chunk) {     // Chunk was empty.
+        chunk -> run -> empty_chunks--;
+    }
+    if (chunk -> free_count == 0) {              // Chunk is full now.
+        chunk_unlink(&slab -> partial, chunk);
+        chunk_push(&slab -> full, chunk);
+        slab -> partial_count--;
+    }
+    return (char*)chunk + slab -> first_object + (word * 64 + bit) * slab -> object_size;
+}
+
+void sf_slab_free(sf_slab* slab, void* obj) {
+    if (obj == NULL) {
+        abort();
+    }
+    sf_slab_chunk* chunk = (sf_slab_chunk*)((size_t)obj & ~(SLAB_CHUNK_SIZE - 1));
+    if (chunk -> slab != slab) {
+        abort();
+    }
+
+    // Object must be at an object boundary of this chunk and not be free already.
+    size_t offset = (char*)obj - (char*)chunk;
+    if (offset < slab -> first_object || (offset - slab -> first_object) % slab -> object_size != 0) {
+        abort();
+    }
+    size_t index = (offset - slab -> first_object) / slab -> object_size;
+    uint64_t mask = (uint64_t)1 << (index % 64);
+    if (index >= slab -> objects_per_chunk || (chunk -> free_bitmap[index / 64] & mask) != 0) {
+        abort();
+    }
+    chunk -> free_bitmap[index / 64] |= mask;
+
+    if (chunk -> free_count++ == 0) {            // Chunk was full, it can serve allocations again.
+        chunk_unlink(&slab -> full, chunk);
+        chunk_push(&slab -> partial, chunk);
+        slab -> partial_count++;
+    }
+    // Give an empty run back to the heap, unless its chunks are the only ones left to allocate from.
+    if (chunk -> free_count == slab -> objects_per_chunk && ++chunk -> run -> empty_chunks == SLAB_RUN_CHUNKS &&
+        slab -> partial_count > SLAB_RUN_CHUNKS) {
+        run_release(slab, chunk -> run);
+    }
+}
+
+void sf_slab_destroy(sf_slab* slab) {
+    // Chunks of a run may sit on either list, so runs are collected first, through their first chunk's prev
+    // pointer, and only freed once no chunk is read any more.
+    sf_slab_chunk* runs = NULL;
+    sf_slab_chunk* lists[2] = {slab -> partial, slab -> full};
+    for (int list = 0; list < 2; list++) {
+        for (sf_slab_chunk* chunk = lists[list]; chunk != NULL; chunk = chunk -> next) {
+            chunk -> slab = NULL;
+            if (chunk -> run == chunk) {
+                chunk -> prev = runs;
+                runs = chunk;
+            }
+        }
+    }
+    while (runs != NULL) {
+        sf_slab_chunk* next = runs -> prev;
+        sf_free(runs);
+        runs = next;
+    }
+    sf_free(slab);
+}
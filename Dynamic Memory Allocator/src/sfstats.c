@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Statistics: every counter is kept up to date where blocks change lists (see STAT_ADD in sfmm_internal.h),
+ * so sf_get_stats() only copies them. Bytes in use are not counted at all, they are whatever part of the heap
+ * is in neither a free list nor a quick list, plus the mappings of huge blocks.
+ */
+
+/*
+ * @return size of the heap, 0 before the first page is added.
+ */
+static size_t heap_bytes(sf_heap_t* heap) {
+    if (heap -> first_page_flag) {
+        return 0;
+    }
+    return (char*)heap_end(heap) - (char*)heap_start(heap);
+}
+
+/*
+ * @return bytes of blocks that are allocated, headers included.
+ */
+static size_t allocated_bytes(sf_heap_t* heap) {
+    size_t heap_size = heap_bytes(heap);
+    size_t unused = STAT_READ(heap, quick_list_bytes) + STAT_READ(heap, deferred_bytes);
+    for (int index = 0; index < SF_NUM_CLASSES; index++) {
+        unused += STAT_READ(heap, free_list_bytes[index]);
+    }
+    if (heap_size > 0) {
+        unused += 16;                   // Paddings at both ends of the heap.
+    }
+
+    // Other threads may be moving blocks right now, never report less than nothing.
+    size_t allocated = heap_size > unused ? heap_size - unused : 0;
+    return allocated + STAT_READ(heap, mapped_bytes);
+}
+
+/*
+ * This method raises the peak to the current number of allocated bytes, if that is higher.
+ * Called after every allocation that takes a block out of a list or maps one.
+ */
+void stats_note_peak(sf_heap_t* heap) {
+    size_t allocated = allocated_bytes(heap);
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+    size_t peak = STAT_READ(heap, peak_allocated_bytes);
+    while (allocated > peak && !__atomic_compare_exchange_n(&heap -> counters.peak_allocated_bytes, &peak, allocated,
+                                                            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    if (allocated > heap -> counters.peak_allocated_bytes) {
+        heap -> counters.peak_allocated_bytes = allocated;
+    }
+#endif
+}
+
+void sf_get_stats(struct sf_stats *stats) {
+    sf_heap_t* heap = &sf_default_heap;
+    stats -> heap_bytes = heap_bytes(heap);
+    stats -> mapped_bytes = STAT_READ(heap, mapped_bytes);
+    stats -> allocated_bytes = allocated_bytes(heap);
+    stats -> peak_allocated_bytes = STAT_READ(heap, peak_allocated_bytes);
+    if (stats -> peak_allocated_bytes < stats -> allocated_bytes) {     // Frees and allocations raced with us.
+        stats -> peak_allocated_bytes = stats -> allocated_bytes;
+    }
+    stats -> quick_list_bytes = STAT_READ(heap, quick_list_bytes);
+    stats -> deferred_bytes = STAT_READ(heap, deferred_bytes);
+
+    stats -> free_bytes = 0;
+    for (int index = 0; index < SF_NUM_CLASSES; index++) {
+        stats -> free_list_bytes[index] = STAT_READ(heap, free_list_bytes[index]);
+        stats -> free_bytes += stats -> free_list_bytes[index];
+    }
+    stats -> largest_free_block = stats -> free_bytes > 0 ? largest_free_block(heap) : 0;
+    stats -> fragmentation = 0;
+    if (stats -> free_bytes > 0 && stats -> largest_free_block < stats -> free_bytes) {
+        stats -> fragmentation = 1.0 - (double)stats -> largest_free_block / stats -> free_bytes;
+    }
+
+    stats -> quick_list_hits = STAT_READ(heap, quick_list_hits);
+    stats -> quick_list_misses = STAT_READ(heap, quick_list_misses);
+    stats -> quick_list_flushes = STAT_READ(heap, quick_list_flushes);
+    stats -> coalesces = STAT_READ(heap, coalesces);
+    stats -> heap_grows = STAT_READ(heap, heap_grows);
+}
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "errno.h"
+
+#ifdef SF_THREAD_CACHE
+
+/*
+ * Thread caches: every thread owns its own set of quick lists for the small block sizes (32 to 176 bytes).
+ * A thread allocates from and frees to its own lists without taking any lock. Only when a list runs dry
+ * (refill) or the cache grows past its byte budget (drain) do we take the heap lock, and then we move a
+ * whole batch of blocks at once. Like the shared quick lists, cached blocks are marked as allocated so
+ * nobody coalesces with them.
+ *
+ * Blocks freed by another thread than the one that allocated them would pile up in the freeing thread's cache,
+ * and its drains would take the heap lock as often as the allocating thread's refills. So every thread with a
+ * cache owns an inbox, a lock free stack that other threads push the blocks they free for it onto, with one CAS.
+ * The owner takes its whole inbox with one exchange on its next miss, which keeps the stack free of ABA problems,
+ * and checks the blocks' neighbours under the heap lock it takes for the refill anyway.
+ *
+ * A refill records the calling thread as owner of the parts of the heap its blocks lie in: owner_table has one
+ * byte per SF_OWNER_GRANULE bytes of the default heap. A granule may hold blocks of several threads, the last one
+ * to refill from it owns them all; a block that reaches another thread's inbox is still reused from there. An
+ * inbox holds at most SF_REMOTE_BYTES, frees beyond that stay with the freeing thread. Threads past the
+ * TCACHE_OWNERS first, or when the table could not be mapped, own nothing and keep what they free.
+ *
+ * A thread that exits closes its inbox first, wipes the owner_table entries it wrote, and then empties the inbox
+ * into the heap until no push is still under way. Only then is its slot free for another thread, frees for the
+ * exited thread are kept by the freeing thread from then on.
+ */
+
+#ifndef SF_TCACHE_BYTES
+#define SF_TCACHE_BYTES 4096    // Maximum number of bytes a single thread may keep in its cache.
+#endif
+#ifndef SF_TCACHE_BATCH
+#define SF_TCACHE_BATCH 8       // Number of blocks moved from the shared heap on a single refill.
+#endif
+#ifndef SF_REMOTE_BYTES
+#define SF_REMOTE_BYTES 16384   // Maximum number of bytes waiting in a single thread's inbox.
+#endif
+#ifndef SF_OWNER_GRANULE
+#define SF_OWNER_GRANULE 256    // Bytes of the heap that share an owner_table entry.
+#endif
+#ifndef SF_OWNER_SPAN
+#define SF_OWNER_SPAN ((size_t)1 << 36)     // Bytes from the start of the default heap that can have an owner.
+#endif
+#define TCACHE_OWNERS 255       // owner_table entries are bytes, 0 stands for no owner.
+#define INBOX_OPEN 1
+#define INBOX_CLOSING 2
+
+static __thread struct {
+    int length;                 // Number of blocks currently in the list.
+    struct sf_block *first;     // Most recently freed block, the oldest one is at the end.
+} tcache_lists[NUM_QUICK_LISTS];
+
+static __thread size_t tcache_bytes;        // Total size of the blocks held by this thread's cache.
+static __thread int tcache_registered;      // Set once the exit destructor is armed for this thread.
+static __thread int tcache_owner;           // Index of this thread's inbox, 0 if it has none.
+static __thread unsigned char* tcache_owned_low;    // owner_table entries this thread wrote lie in between.
+static __thread unsigned char* tcache_owned_high;
+
+static struct tcache_inbox {
+    struct sf_block *first;     // Linked through body.links.next, NULL terminated.
+    size_t bytes;               // Bytes in the inbox, or about to be pushed.
+    int taken;                  // INBOX_OPEN while a thread owns this inbox, INBOX_CLOSING while it exits.
+} __attribute__((aligned(64))) tcache_inboxes[TCACHE_OWNERS + 1];
+
+static unsigned char* owner_table;          // Lazily backed mapping, SF_OWNER_SPAN / SF_OWNER_GRANULE entries.
+static char* owner_base;                    // Heap start the table is indexed from, set by the first refill.
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void tcache_drain(int list_location, int count);
+static void inbox_release(sf_heap_t* heap, int owner);
+static void disown_blocks(int owner);
+
+/*
+ * Thread exit destructor, returns every cached block to the shared heap and gives up this thread's inbox.
+ */
+static void tcache_release(void* unused) {
+    for (int index = 0; index < NUM_QUICK_LISTS; index++) {
+        tcache_drain(index, tcache_lists[index].length);
+    }
+    if (tcache_owner != 0) {
+        sf_heap_t* heap = &sf_default_heap;
+        int owner = tcache_owner;
+        tcache_owner = 0;
+        // Pushes that saw the inbox open still count their bytes, they are taken once they land.
+        __atomic_store_n(&tcache_inboxes[owner].taken, INBOX_CLOSING, __ATOMIC_SEQ_CST);
+        disown_blocks(owner);
+        while (1) {
+            SF_HEAP_LOCK(heap);
+            inbox_release(heap, owner);
+            SF_HEAP_UNLOCK(heap);
+            if (__atomic_load_n(&tcache_inboxes[owner].bytes, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            }
+            sched_yield();
+        }
+        __atomic_store_n(&tcache_inboxes[owner].taken, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void tcache_make_key() {
+    pthread_key_create(&tcache_key, tcache_release);
+    void* table = mmap(NULL, SF_OWNER_SPAN / SF_OWNER_GRANULE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table != MAP_FAILED) {
+        owner_table = table;
+    }
+}
+
+/*
+ * This method arms tcache_release() for the calling thread and gives it a free inbox. Value stored for the key
+ * is never read, it only needs to be non NULL for the destructor to run. Flag is set first: when we are the
+ * process' malloc, pthread_setspecific() may allocate and come back here.
+ */
+static void tcache_register() {
+    tcache_registered = 1;
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, &tcache_bytes);
+    for (int owner = 1; owner <= TCACHE_OWNERS && owner_table != NULL; owner++) {
+        int free_slot = 0;
+        if (__atomic_load_n(&tcache_inboxes[owner].taken, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&tcache_inboxes[owner].taken, &free_slot, INBOX_OPEN, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            tcache_owner = owner;
+            break;
+        }
+    }
+}
+
+/*
+ * This method finds the owner_table entry of a block of the default heap.
+ *
+ * @return the entry, or NULL if the block is outside of the part of the heap the table covers.
+ */
+static unsigned char* owner_entry(sf_block* block) {
+    char* base = __atomic_load_n(&owner_base, __ATOMIC_ACQUIRE);
+    size_t offset = (char*)&block -> header - base;
+    if (base == NULL || owner_table == NULL || offset >= SF_OWNER_SPAN) {
+        return NULL;
+    }
+    return &owner_table[offset / SF_OWNER_GRANULE];
+}
+
+/*
+ * This method records the calling thread as owner of a block it is about to hand out. Entry is only written when
+ * it changes, so a granule a single thread keeps allocating from stays shared in every cache.
+ */
+static void own_block(sf_block* block) {
+    unsigned char* entry = owner_entry(block);
+    if (entry != NULL && __atomic_load_n(entry, __ATOMIC_RELAXED) != tcache_owner) {
+        __atomic_store_n(entry, (unsigned char)tcache_owner, __ATOMIC_RELAXED);
+        if (tcache_owned_low == NULL || entry < tcache_owned_low) {
+            tcache_owned_low = entry;
+        }
+        if (entry >= tcache_owned_high) {
+            tcache_owned_high = entry + 1;
+        }
+    }
+}
+
+/*
+ * This method clears the owner_table entries that still name an exiting thread, so that frees stop looking for
+ * its inbox, and a thread getting its slot later is not sent blocks it never had. Entries another thread took
+ * over in the meantime are left alone.
+ */
+static void disown_blocks(int owner) {
+    for (unsigned char* entry = tcache_owned_low; entry != NULL && entry < tcache_owned_high; entry++) {
+        unsigned char expected = (unsigned char)owner;
+        if (__atomic_load_n(entry, __ATOMIC_RELAXED) == expected) {
+            __atomic_compare_exchange_n(entry, &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+    tcache_owned_low = tcache_owned_high = NULL;
+}
+
+/*
+ * This method pushes a block freed by the calling thread onto its owner's inbox, if the owner is still running
+ * and there is room.
+ *
+ * @return 1 if the block was pushed, 0 if the caller keeps it.
+ */
+static int inbox_push(int owner, sf_block* block, size_t size) {
+    struct tcache_inbox* inbox = &tcache_inboxes[owner];
+    if (__atomic_load_n(&inbox -> taken, __ATOMIC_RELAXED) != INBOX_OPEN) {
+        return 0;
+    }
+    // Bytes are counted before the inbox is checked again, an exiting owner waits until they are taken.
+    if (__atomic_add_fetch(&inbox -> bytes, size, __ATOMIC_SEQ_CST) > SF_REMOTE_BYTES ||
+        __atomic_load_n(&inbox -> taken, __ATOMIC_SEQ_CST) != INBOX_OPEN) {
+        __atomic_sub_fetch(&inbox -> bytes, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    sf_block* head = __atomic_load_n(&inbox -> first, __ATOMIC_RELAXED);
+    do {
+        block -> body.links.next = head;
+    } while (!__atomic_compare_exchange_n(&inbox -> first, &head, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * This method takes the whole inbox of an owner. Blocks were only checked against their own headers when they
+ * were freed, their neighbours are checked here. Caller holds the heap lock.
+ *
+ * @return first block of the inbox, linked through body.links.next, or NULL if it was empty.
+ */
+static sf_block* inbox_take(sf_heap_t* heap, int owner) {
+    struct tcache_inbox* inbox = &tcache_inboxes[owner];
+    // Looking first leaves the line of an empty inbox shared, the exchange would take it over.
+    if (__atomic_load_n(&inbox -> first, __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+    sf_block* taken = __atomic_exchange_n(&inbox -> first, NULL, __ATOMIC_ACQUIRE);
+    size_t bytes = 0;
+    for (sf_block* block = taken; block != NULL; block = block -> body.links.next) {
+        if (!is_valid_header(heap, block -> body.payload)) {
+            abort();
+        }
+        bytes += (block -> header^MAGIC) & ~0x6;
+    }
+    __atomic_sub_fetch(&inbox -> bytes, bytes, __ATOMIC_RELAXED);
+    return taken;
+}
+
+/*
+ * This method frees every block of an owner's inbox to the heap. Caller holds the heap lock.
+ */
+static void inbox_release(sf_heap_t* heap, int owner) {
+    sf_block* block = inbox_take(heap, owner);
+    while (block != NULL) {
+        sf_block* next = block -> body.links.next;
+        free_block(heap, &block -> header);
+        block = next;
+    }
+}
+
+/*
+ * This method moves the calling thread's inbox into its cache, as far as the budget allows; the rest is freed to
+ * the heap. Caller holds the heap lock.
+ *
+ * @return a block of given size for the current allocation, or NULL if the inbox had none.
+ */
+static sf_block* inbox_refill(sf_heap_t* heap, size_t size) {
+    sf_block* block_to_return = NULL;
+    sf_block* block = inbox_take(heap, tcache_owner);
+    while (block != NULL) {
+        sf_block* next = block -> body.links.next;
+        size_t block_size = (block -> header^MAGIC) & ~0x6;
+        int list_location = (block_size - 32) / 16;
+        if (block_to_return == NULL && block_size == size) {
+            block_to_return = block;
+        }
+        else if (tcache_bytes + block_size <= SF_TCACHE_BYTES) {
+            block -> body.links.next = tcache_lists[list_location].first;
+            tcache_lists[list_location].first = block;
+            tcache_lists[list_location].length++;
+            tcache_bytes += block_size;
+        }
+        else {
+            free_block(heap, &block -> header);
+        }
+        block = next;
+    }
+    return block_to_return;
+}
+
+/*
+ * This method refills a list under a single lock: from this thread's inbox if that holds a block of given size,
+ * otherwise with a batch of up to SF_TCACHE_BATCH blocks from the shared heap. First block is returned to the
+ * caller, the rest go into this thread's list. Batch is cut short so the cache stays within its budget.
+ *
+ * @return block for the current allocation, or NULL if shared heap is out of memory.
+ */
+static sf_block* tcache_refill(int list_location, size_t size) {
+    sf_heap_t* heap = &sf_default_heap;
+    SF_HEAP_LOCK(heap);
+    if (tcache_owner != 0) {
+        sf_block* block = inbox_refill(heap, size);
+        if (block != NULL) {
+            SF_HEAP_UNLOCK(heap);
+            return block;
+        }
+    }
+
+    int count = SF_TCACHE_BATCH - 1;
+    if (tcache_bytes + count * size > SF_TCACHE_BYTES) {
+        count = (SF_TCACHE_BYTES - tcache_bytes) / size;
+    }
+    sf_block* block_to_return = malloc_block(heap, size);
+    if (block_to_return != NULL && owner_base == NULL) {
+        __atomic_store_n(&owner_base, (char*)heap_start(heap), __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < count && block_to_return != NULL; i++) {
+        sf_block* block = malloc_block(heap, size);
+        if (block == NULL) {    // Shared heap is out of memory, keep whatever we already got.
+            break;
+        }
+        // Free lists may hand out a block slightly larger than asked, rather than leaving a splinter.
+        // Such block does not belong in this list, give it back and stop.
+        if (((block -> header^MAGIC) & ~0x6) != size) {
+            free_block(heap, &block -> header);
+            break;
+        }
+        own_block(block);
+        block -> body.links.next = tcache_lists[list_location].first;
+        tcache_lists[list_location].first = block;
+        tcache_lists[list_location].length++;
+        tcache_bytes += size;
+    }
+    SF_HEAP_UNLOCK(heap);
+    if (block_to_return != NULL) {
+        own_block(block_to_return);
+    }
+    return block_to_return;
+}
+
+/*
+ * This method gives `count` oldest blocks of a list back to the shared heap, under a single lock. Blocks go
+ * through the shared quick lists, so they are flushed and coalesced the same way as a regular sf_free() would do.
+ */
+static void tcache_drain(int list_location, int count) {
+    if (count <= 0) {
+        return;
+    }
+
+    // Oldest blocks are at the end of the list. Cut the list right after the ones we keep.
+    int keep = tcache_lists[list_location].length - count;
+    sf_block* drained;
+    if (keep == 0) {
+        drained = tcache_lists[list_location].first;
+        tcache_lists[list_location].first = NULL;
+    } else {
+        sf_block* last_kept = tcache_lists[list_location].first;
+        for (int i = 1; i < keep; i++) {
+            last_kept = last_kept -> body.links.next;
+        }
+        drained = last_kept -> body.links.next;
+        last_kept -> body.links.next = NULL;
+    }
+    tcache_lists[list_location].length = keep;
+    size_t size = 32 + 16 * (size_t)list_location;
+    tcache_bytes -= count * size;
+
+    sf_heap_t* heap = &sf_default_heap;
+    SF_HEAP_LOCK(heap);
+    while (drained != NULL) {
+        sf_block* next = drained -> body.links.next;
+        // Neighbour checks of is_valid_header() were skipped on the lock free path, do them now.
+        if (!is_valid_header(heap, drained -> body.payload)) {
+            abort();
+        }
+        free_block(heap, &drained -> header);
+        drained = next;
+    }
+    SF_HEAP_UNLOCK(heap);
+}
+
+/*
+ * This method serves a small allocation from the calling thread's cache.
+ *
+ * @param size Block size, header included, already rounded to 16 bytes.
+ * @return block marked as allocated, or NULL if shared heap is out of memory.
+ */
+sf_block* tcache_malloc(size_t size) {
+    int list_location = (size - 32) / 16;
+
+    if (!tcache_registered) {
+        tcache_register();
+    }
+    if (tcache_lists[list_location].length == 0) {
+        return tcache_refill(list_location, size);
+    }
+
+    sf_block* block = tcache_lists[list_location].first;     // Take most recently freed block.
+    tcache_lists[list_location].first = block -> body.links.next;
+    tcache_lists[list_location].length--;
+    tcache_bytes -= size;
+    return block;
+}
+
+/*
+ * This method puts a freed small block into the calling thread's cache. If this takes the cache over its
+ * budget, the oldest half of the list is drained to the shared heap first.
+ *
+ * @return 1 if the block was taken, 0 if it is not a small block and must be freed to the shared heap.
+ * If ptr is invalid, abort() is called.
+ */
+int tcache_free(void* ptr) {
+    if (!is_valid_block(&sf_default_heap, ptr)) {
+        abort();
+    }
+
+    sf_header* block_header = (sf_header*)ptr - 1;
+    return tcache_free_block(block_header, (*block_header^MAGIC) & ~0x6);
+}
+
+/*
+ * This method is tcache_free() for a block that is already known to be valid and of given size.
+ */
+int tcache_free_block(sf_header* block_header, size_t block_size) {
+    int list_location = (block_size - 32) / 16;
+    if (list_location >= NUM_QUICK_LISTS) {
+        return 0;
+    }
+
+    if (!tcache_registered) {
+        tcache_register();
+    }
+
+    // Block of another thread goes back to that thread, without touching our lists or theirs.
+    sf_block* block = (sf_block*)(block_header - 1);     // Block struct starts at previous block's footer.
+    unsigned char* entry = owner_entry(block);
+    int owner = entry != NULL ? __atomic_load_n(entry, __ATOMIC_RELAXED) : 0;
+    if (owner != 0 && owner != tcache_owner && inbox_push(owner, block, block_size)) {
+        return 1;
+    }
+
+    if (tcache_bytes + block_size > SF_TCACHE_BYTES) {
+        tcache_drain(list_location, (tcache_lists[list_location].length + 1) / 2);
+        if (tcache_bytes + block_size > SF_TCACHE_BYTES) {
+            // Budget is held by other sizes, let this block skip the cache.
+            sf_heap_t* heap = &sf_default_heap;
+            SF_HEAP_LOCK(heap);
+            if (!is_valid_header(heap, block_header + 1)) {
+                abort();
+            }
+            free_block(heap, block_header);
+            SF_HEAP_UNLOCK(heap);
+            return 1;
+        }
+    }
+
+    block -> body.links.next = tcache_lists[list_location].first;
+    tcache_lists[list_location].first = block;
+    tcache_lists[list_location].length++;
+    tcache_bytes += block_size;
+    return 1;
+}
+
+#endif
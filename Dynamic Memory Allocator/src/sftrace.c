@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+#ifdef SF_TRACE
+
+/*
+ * Trace recorder: the public allocation functions below wrap the ones of sfmm.c and sfbatch.c, which are compiled
+ * as sf_*_untraced in this mode. Every thread appends its records to a buffer of its own and writes the buffer to
+ * the trace file with a single write() once it is full. Buffers are mapped with mmap(), never taken from the heap
+ * being traced, and are kept in a list so that sf_trace_flush() and exit can write out what is left in them.
+ * A buffer is taken with its busy flag by whoever adds records or writes them out, which is its own thread but for
+ * sf_trace_flush() from another thread, so the flag is next to never contended.
+ * A buffer whose thread ended is taken over by the next new thread.
+ */
+
+#ifndef SF_TRACE_BUFFER
+#define SF_TRACE_BUFFER 4096    // Records a thread buffers before writing them out.
+#endif
+
+typedef struct trace_buffer {
+    struct trace_buffer* next;  // Every buffer ever mapped.
+    int in_use;                 // Set while a thread owns the buffer.
+    int busy;                   // Set while records are added or written out, see trace_lock().
+    int count;                  // Records waiting in the buffer.
+    sf_trace_record records[SF_TRACE_BUFFER];
+} trace_buffer;
+
+void* sf_malloc_untraced(size_t size);
+void* sf_calloc_untraced(size_t nmemb, size_t size);
+void* sf_realloc_untraced(void* ptr, size_t size);
+void* sf_memalign_untraced(size_t size, size_t align);
+void sf_free_untraced(void* ptr);
+void sf_free_sized_untraced(void* ptr, size_t size);
+size_t sf_malloc_batch_untraced(size_t size, size_t count, void** ptrs);
+void sf_free_batch_untraced(void** ptrs, size_t count);
+
+static int trace_fd = -1;                   // -1 until opened, and if the file could not be opened.
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_buffer* trace_buffers;         // Head of the list of all buffers.
+static __thread trace_buffer* trace_local;  // Buffer of the calling thread.
+
+/*
+ * These methods take a buffer for adding records or writing them out, and give it back.
+ */
+static void trace_lock(trace_buffer* buffer) {
+    while (__atomic_exchange_n(&buffer -> busy, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void trace_unlock(trace_buffer* buffer) {
+    __atomic_store_n(&buffer -> busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * This method writes out the records of a buffer. Caller must have taken the buffer.
+ */
+static void trace_write(trace_buffer* buffer) {
+    int count = buffer -> count;
+    if (count > 0 && trace_fd != -1) {
+        if (write(trace_fd, buffer -> records, count * sizeof(sf_trace_record)) != (ssize_t)(count * sizeof(sf_trace_record))) {
+            trace_fd = -1;          // Disk full or similar, better to stop than to leave holes in the trace.
+        }
+    }
+    buffer -> count = 0;
+}
+
+/*
+ * Thread exit destructor, flushes the thread's buffer and hands it over to the next thread.
+ */
+static void trace_release(void* buffer) {
+    trace_lock(buffer);
+    trace_write(buffer);
+    trace_unlock(buffer);
+    __atomic_store_n(&((trace_buffer*)buffer) -> in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_exit() {
+    sf_trace_flush();
+}
+
+/*
+ * A forked child keeps a copy of the parent's buffers, records in them would be written twice. Child stops tracing.
+ */
+static void trace_fork_child() {
+    trace_fd = -1;
+}
+
+static void trace_open() {
+    const char* path = getenv("SF_TRACE_FILE");
+    if (path == NULL) {
+        path = "sfmm.trace";
+    }
+    pthread_key_create(&trace_key, trace_release);
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd != -1 && write(trace_fd, SF_TRACE_MAGIC, 8) != 8) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    atexit(trace_exit);
+    pthread_atfork(NULL, NULL, trace_fork_child);
+}
+
+/*
+ * This method gives the calling thread a buffer: one left by a thread that ended, or a new one.
+ *
+ * @return the buffer, or NULL if none could be mapped.
+ */
+static trace_buffer* trace_attach() {
+    pthread_once(&trace_once, trace_open);
+
+    trace_buffer* buffer;
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer -> next) {
+        int free_buffer = 0;
+        if (__atomic_compare_exchange_n(&buffer -> in_use, &free_buffer, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (buffer == NULL) {
+        buffer = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            return NULL;
+        }
+        buffer -> in_use = 1;
+        buffer -> next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer -> next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    // Buffer is ours before pthread_setspecific(), which may allocate and come back here.
+    trace_local = buffer;
+    pthread_setspecific(trace_key, buffer);
+    return buffer;
+}
+
+static uint64_t trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * This method appends a record to the calling thread's buffer, writing the buffer out first if it is full.
+ */
+static void trace_record(uint64_t time, int op, void* id, uint64_t arg, size_t size) {
+    trace_buffer* buffer = trace_local;
+    if (buffer == NULL && (buffer = trace_attach()) == NULL) {
+        return;
+    }
+    trace_lock(buffer);
+    if (buffer -> count == SF_TRACE_BUFFER) {
+        trace_write(buffer);
+    }
+
+    sf_trace_record* record = &buffer -> records[buffer -> count++];
+    record -> time = time;
+    record -> id = (uint64_t)(size_t)id;
+    record -> arg = arg;
+    record -> size = size;
+    record -> op = op;
+    trace_unlock(buffer);
+}
+
+/*
+ * Buffers of running threads are taken one at a time, so their threads only wait while that one is written.
+ */
+void sf_trace_flush() {
+    for (trace_buffer* buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer -> next) {
+        trace_lock(buffer);
+        trace_write(buffer);
+        trace_unlock(buffer);
+    }
+}
+
+void *sf_malloc(size_t size) {
+    void* ptr = sf_malloc_untraced(size);
+    if (ptr != NULL) {
+        trace_record(trace_now(), SF_TRACE_MALLOC, ptr, 0, size);
+    }
+    return ptr;
+}
+
+void *sf_calloc(size_t nmemb, size_t size) {
+    void* ptr = sf_calloc_untraced(nmemb, size);
+    if (ptr != NULL) {
+        trace_record(trace_now(), SF_TRACE_CALLOC, ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+/*
+ * Time is taken before the call: the old block may be freed and handed to another thread before we return.
+ */
+void *sf_realloc(void *pp, size_t rsize) {
+    uint64_t time = trace_now();
+    void* ptr = sf_realloc_untraced(pp, rsize);
+    if (rsize == 0) {
+        trace_record(time, SF_TRACE_FREE, pp, 0, 0);
+    }
+    else if (ptr != NULL) {
+        trace_record(time, SF_TRACE_REALLOC, ptr, (uint64_t)(size_t)pp, rsize);
+    }
+    return ptr;
+}
+
+void *sf_memalign(size_t size, size_t align) {
+    void* ptr = sf_memalign_untraced(size, align);
+    if (ptr != NULL) {
+        trace_record(trace_now(), SF_TRACE_MEMALIGN, ptr, align, size);
+    }
+    return ptr;
+}
+
+/*
+ * Frees are recorded before the call, once the block is free another thread may get it back.
+ */
+void sf_free(void *pp) {
+    trace_record(trace_now(), SF_TRACE_FREE, pp, 0, 0);
+    sf_free_untraced(pp);
+}
+
+void sf_free_sized(void *ptr, size_t size) {
+    trace_record(trace_now(), SF_TRACE_FREE, ptr, 0, 0);
+    sf_free_sized_untraced(ptr, size);
+}
+
+size_t sf_malloc_batch(size_t size, size_t count, void **ptrs) {
+    size_t filled = sf_malloc_batch_untraced(size, count, ptrs);
+    uint64_t time = trace_now();
+    for (size_t i = 0; i < filled; i++) {
+        trace_record(time, SF_TRACE_MALLOC, ptrs[i], 0, size);
+    }
+    return filled;
+}
+
+void sf_free_batch(void **ptrs, size_t count) {
+    uint64_t time = trace_now();
+    for (size_t i = 0; i < count; i++) {
+        trace_record(time, SF_TRACE_FREE, ptrs[i], 0, 0);
+    }
+    sf_free_batch_untraced(ptrs, count);
+}
+
+#else
+
+void sf_trace_flush() {
+}
+
+#endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+#include "sfmm_ext.h"
+#include "errno.h"
+
+/*
+ * Trimming: the pages in the middle of a free block hold nothing we need. madvise(MADV_DONTNEED) drops them from
+ * the resident set; they read back as zeros when touched again. Header, list links, skip list pointers and footer
+ * of the block stay in place, so the block remains a valid member of its free list and coalescing works as before.
+ * Where the heap can shrink (see mem_shrink() in sfmm.c), sf_trim() also lowers its end into the last free block.
+ */
+
+/*
+ * This method finds the whole pages of a free block that can be released: all of them except for its
+ * bookkeeping rows and the last `keep` bytes before its footer.
+ *
+ * @return 1 with the pages from *start up to *end, 0 if there are none.
+ */
+static int releasable_pages(sf_header* block_header, size_t keep, char** start, char** end) {
+    size_t block_size = (*block_header^MAGIC) & ~0x6;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // Bookkeeping of the largest free blocks ends with the skip list pointers, smaller ones need even less.
+    size_t low = (size_t)(block_header - 1) + sizeof(sf_large_block);
+    size_t high = (size_t)(block_header + block_size/8 - 1);           // Footer of the block.
+    if (high - low <= keep) {
+        return 0;
+    }
+    high -= keep;
+
+    low = (low + page_size - 1) & ~(page_size - 1);
+    high &= ~(page_size - 1);
+    if (high <= low) {
+        return 0;
+    }
+    *start = (char*)low;
+    *end = (char*)high;
+    return 1;
+}
+
+/*
+ * This method finds the whole pages of released range `index` that lie from `start` up to `end`. Allocations cut
+ * ranges at any row, only the whole pages left in them are still released.
+ *
+ * @return 1 with the pages from *low up to *high, 0 if there are none.
+ */
+static int released_pages(sf_heap_t* heap, int index, char* start, char* end, char** low, char** high) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char* range_low = (char*)(((size_t)heap -> released[index].start + page_size - 1) & ~(page_size - 1));
+    char* range_high = (char*)((size_t)heap -> released[index].end & ~(page_size - 1));
+    *low = range_low > start ? range_low : start;
+    *high = range_high < end ? range_high : end;
+    return *low < *high;
+}
+
+/*
+ * This method releases the pages from `start` up to `end` that are not released yet, if there are at least
+ * `least` bytes of them, and records them. Released ranges overlapping them are merged into one; otherwise the
+ * new range takes an empty slot, or the one of the smallest range, whose pages are then forgotten.
+ *
+ * @return number of bytes released.
+ */
+static size_t release_range(sf_heap_t* heap, char* start, char* end, size_t least) {
+    size_t known = 0;
+    char* low;
+    char* high;
+    for (int i = 0; i < RELEASED_RANGES; i++) {
+        if (released_pages(heap, i, start, end, &low, &high)) {
+            known += high - low;
+        }
+    }
+    if ((size_t)(end - start) - known < least) {
+        return 0;
+    }
+
+    // Ranges do not overlap, so the gaps between them are released in address order.
+    size_t released = 0;
+    char* position = start;
+    while (position < end) {
+        char* next_low = end;
+        char* next_high = end;
+        for (int i = 0; i < RELEASED_RANGES; i++) {
+            if (released_pages(heap, i, start, end, &low, &high) && high > position && low < next_low) {
+                next_low = low > position ? low : position;
+                next_high = high;
+            }
+        }
+        if (next_low > position && madvise(position, next_low - position, MADV_DONTNEED) == 0) {
+            released += next_low - position;
+        }
+        position = next_high;
+    }
+
+    // Merged range spans every range it overlaps, their pages around start..end are still released.
+    for (int i = 0; i < RELEASED_RANGES; i++) {
+        sf_range* range = &heap -> released[i];
+        if (range -> start < end && range -> end > start) {
+            start = range -> start < start ? range -> start : start;
+            end = range -> end > end ? range -> end : end;
+            range -> start = range -> end = NULL;
+        }
+    }
+    int slot = 0;
+    for (int i = 1; i < RELEASED_RANGES; i++) {
+        if (heap -> released[i].end - heap -> released[i].start < heap -> released[slot].end - heap -> released[slot].start) {
+            slot = i;
+        }
+    }
+    __atomic_store_n(&heap -> released[slot].start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap -> released[slot].end, end, __ATOMIC_RELAXED);
+    return released;
+}
+
+/*
+ * This method releases the pages of a block that was just freed into a large free block, like sf_trim() does
+ * for the last block, keeping SF_TRIM_PAD bytes at its end resident for the next allocations cut from there.
+ * Pages released before are not released again, and nothing is released until there are SF_TRIM_THRESHOLD
+ * bytes of new ones, so a block that shrinks and grows by a little does not go back to the kernel on every free.
+ */
+void trim_free_block(sf_heap_t* heap, sf_header* block_header) {
+    char* start;
+    char* end;
+    if (releasable_pages(block_header, SF_TRIM_PAD, &start, &end)) {
+        release_range(heap, start, end, SF_TRIM_THRESHOLD);
+    }
+}
+
+/*
+ * This method lowers the end of the heap by as many pages as the free block at the end of the heap can lose,
+ * leaving it at least `keep` bytes besides its header and footer.
+ *
+ * @return number of bytes given back that were not released before.
+ */
+static size_t lower_heap(sf_heap_t* heap, sf_header* tail_header, size_t keep) {
+    size_t tail_size = (*tail_header^MAGIC) & ~0x6;
+    size_t least = (keep + 16 + 15) & ~15;
+    least = least < 32 ? 32 : least;
+    if (least >= tail_size || tail_size - least < PAGE_SZ) {
+        return 0;
+    }
+    size_t pages = (tail_size - least) / PAGE_SZ;
+    char* old_end = heap_end(heap);
+    char* new_end = old_end - pages * PAGE_SZ;
+    if (mem_shrink(heap, pages) == -1) {
+        return 0;
+    }
+
+    // Pages past the new end are gone, released or not.
+    size_t given_back = pages * PAGE_SZ;
+    char* low;
+    char* high;
+    for (int i = 0; i < RELEASED_RANGES; i++) {
+        if (released_pages(heap, i, new_end, old_end, &low, &high)) {
+            given_back -= high - low;
+        }
+        if (heap -> released[i].end > new_end) {
+            heap -> released[i].end = heap -> released[i].start < new_end ? new_end : heap -> released[i].start;
+        }
+    }
+    return given_back;
+}
+
+size_t sf_trim(size_t keep) {
+    sf_heap_t* heap = &sf_default_heap;
+    size_t released = 0;
+
+    setup_heap();
+    SF_HEAP_LOCK(heap);
+#ifdef SF_DEFERRED_COALESCE
+    defer_sweep(heap);                  // Parked blocks hold pages too, free them first.
+#endif
+    SF_TAGS_EXCLUSIVE_LOCK(heap);
+    if (heap_start(heap) != heap_end(heap)) {
+        // Free block at the end of the heap, if any, is the one that keeps `keep` bytes.
+        sf_footer* reserved_footer = (sf_footer*)heap_end(heap) - 1;
+        sf_header* tail_header = NULL;
+        if (((*reserved_footer^MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
+            tail_header = reserved_footer - 1 - (((*(reserved_footer - 1)^MAGIC) & ~0x6)/8 - 1);
+        }
+        if (tail_header != NULL) {
+            released += lower_heap(heap, tail_header, keep);
+        }
+
+        for (int index = 0; index < SF_NUM_CLASSES; index++) {
+            sf_block* list_dummy = &heap -> class_heads[index];
+            for (sf_block* block = list_dummy -> body.links.next; block != list_dummy; block = block -> body.links.next) {
+                char* start;
+                char* end;
+                if (releasable_pages(&block -> header, &block -> header == tail_header ? keep : 0, &start, &end)) {
+                    released += release_range(heap, start, end, 0);
+                }
+            }
+        }
+    }
+    SF_TAGS_UNLOCK(heap);
+    SF_HEAP_UNLOCK(heap);
+    return released;
+}
@@ -0,0 +1,886 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Tests run on lib/sfutil.o, whose heap is 16 pages, and every test gets a process and a heap of its own.
+ * "make threaded" and "make striped" build the same tests against the other locking schemes; the thread cache
+ * suite only exists with SF_THREAD_CACHE. "make deferred" and "make trace" add tests of those modes.
+ */
+
+#define TEST_TIMEOUT 15
+
+/*
+ * With SF_THREAD_CACHE, small blocks the test frees stay in its thread's cache and count as allocated.
+ */
+#ifdef SF_THREAD_CACHE
+#define CACHED_BYTES 4096       // SF_TCACHE_BYTES.
+#else
+#define CACHED_BYTES 0
+#endif
+
+/*
+ * Bytes in allocated blocks as sf_get_stats() counts them, huge blocks included.
+ */
+static size_t allocated_bytes() {
+    struct sf_stats stats;
+    sf_get_stats(&stats);
+    return stats.allocated_bytes;
+}
+
+static void assert_all_freed(size_t before) {
+    size_t after = allocated_bytes();
+    cr_assert(after >= before && after <= before + CACHED_BYTES, "allocated_bytes went from %zu to %zu", before, after);
+}
+
+static void assert_filled(char* ptr, int value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        cr_assert_eq(ptr[i], (char)value, "Byte %zu is %d instead of %d", i, ptr[i], value);
+    }
+}
+
+Test(sfmm_basecode_suite, malloc_free, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    char* x = sf_malloc(200);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert_eq((uintptr_t)x % 16, 0, "x is not aligned to 16 bytes");
+    memset(x, 0x5a, 200);
+    cr_assert_eq(allocated_bytes(), 208, "allocated_bytes is %zu", allocated_bytes());
+    sf_free(x);
+    cr_assert_eq(allocated_bytes(), 0, "allocated_bytes is %zu", allocated_bytes());
+    cr_assert_not_null(sf_malloc(200), "Heap is unusable after free");
+    cr_assert_eq(sf_errno, 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_basecode_suite, malloc_zero_and_too_large, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert_null(sf_malloc(0), "sf_malloc(0) did not return NULL");
+    cr_assert_eq(sf_errno, 0, "sf_malloc(0) set sf_errno");
+    cr_assert_null(sf_malloc(SIZE_MAX), "sf_malloc(SIZE_MAX) did not return NULL");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+    sf_errno = 0;
+    cr_assert_null(sf_malloc(SIZE_MAX - 8), "Size rounding wrapped around");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_basecode_suite, free_twice_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    void* x = sf_malloc(1000);
+    sf_free(x);
+    sf_free(x);
+}
+
+Test(sfmm_realloc_suite, realloc_grows_in_place, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(1000);
+    char* y = sf_malloc(1000);
+    sf_malloc(100);                 // Keeps the two apart from the rest of the heap.
+    char* low = x < y ? x : y;
+    char* high = x < y ? y : x;
+    memset(low, 0x11, 1000);
+    sf_free(high);
+
+    char* z = sf_realloc(low, 1800);
+    cr_assert_eq(z, low, "Block did not grow into its free neighbour");
+    assert_filled(z, 0x11, 1000);
+}
+
+Test(sfmm_realloc_suite, realloc_grows_at_heap_end, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(PAGE_SZ);
+    memset(x, 0x22, PAGE_SZ);
+    char* y = sf_realloc(x, 3 * PAGE_SZ);
+    cr_assert_eq(y, x, "Block at the end of the heap did not grow in place");
+    assert_filled(y, 0x22, PAGE_SZ);
+}
+
+Test(sfmm_realloc_suite, realloc_shrinks_in_place, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(2000);
+    memset(x, 0x33, 2000);
+    size_t before = allocated_bytes();
+    char* y = sf_realloc(x, 100);
+    cr_assert_eq(y, x, "Block did not shrink in place");
+    assert_filled(y, 0x33, 100);
+    cr_assert_lt(allocated_bytes(), before, "Shrinking did not give the tail back");
+}
+
+Test(sfmm_realloc_suite, realloc_invalid_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    char* x = sf_malloc(300);
+    *(sf_header*)(x + 8) = (16 | THIS_BLOCK_ALLOCATED)^MAGIC;       // Payload bytes in front of x + 16.
+    sf_realloc(x + 16, 100);
+}
+
+Test(sfmm_realloc_suite, realloc_too_large_and_zero, .timeout = TEST_TIMEOUT) {
+    void* x = sf_malloc(300);
+    sf_errno = 0;
+    cr_assert_null(sf_realloc(x, SIZE_MAX), "Oversized realloc did not fail");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+    sf_errno = 0;
+    cr_assert_null(sf_realloc(x, 0), "sf_realloc(x, 0) did not return NULL");
+    cr_assert_eq(sf_errno, 0, "sf_realloc(x, 0) set sf_errno");
+}
+
+Test(sfmm_grow_suite, grow_carves_from_new_pages, .timeout = TEST_TIMEOUT) {
+    // 3 pages and a header need a 4th page, the first one also holds the heap's padding rows.
+    char* x = sf_malloc(3 * PAGE_SZ);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert_eq((char*)sf_mem_end() - (char*)sf_mem_start(), 4 * PAGE_SZ, "Heap did not grow by exactly 4 pages");
+    cr_assert_eq(x, (char*)sf_mem_start() + 16, "Block was not cut from the start of the new pages");
+
+    // Free block left at the end of the heap is extended and the next block starts where it did.
+    char* y = sf_malloc(6000);
+    cr_assert_eq((char*)sf_mem_end() - (char*)sf_mem_start(), 5 * PAGE_SZ, "Heap did not grow by exactly 1 page");
+    cr_assert_eq(y, x + 3 * PAGE_SZ + 16, "Block was not cut from the start of the free block at the end");
+    cr_assert_eq(allocated_bytes(), 3 * PAGE_SZ + 16 + 6016, "allocated_bytes is %zu", allocated_bytes());
+}
+
+Test(sfmm_mmap_suite, mmap_threshold, .timeout = TEST_TIMEOUT) {
+    char* below = sf_malloc(SF_MMAP_THRESHOLD - 64);
+    cr_assert_not_null(below, "below is NULL!");
+    cr_assert(below >= (char*)sf_mem_start() && below < (char*)sf_mem_end(), "Block below the threshold was mapped");
+    void* heap_end = sf_mem_end();
+
+    char* above = sf_malloc(SF_MMAP_THRESHOLD);
+    cr_assert_not_null(above, "above is NULL!");
+    cr_assert(above < (char*)sf_mem_start() || above >= (char*)sf_mem_end(), "Huge block is in the heap");
+    cr_assert(IS_MMAPPED((sf_header*)above - 1), "Huge block is not marked as mapped");
+    cr_assert_eq(sf_mem_end(), heap_end, "Huge block grew the heap");
+    memset(above, 0x55, SF_MMAP_THRESHOLD);
+
+    char* grown = sf_realloc(above, 4 * SF_MMAP_THRESHOLD);
+    cr_assert_not_null(grown, "grown is NULL!");
+    assert_filled(grown, 0x55, SF_MMAP_THRESHOLD);
+    sf_free(below);
+
+    // Shrunk below the threshold, the block moves into the heap.
+    char* shrunk = sf_realloc(grown, 1000);
+    cr_assert(shrunk >= (char*)sf_mem_start() && shrunk < (char*)sf_mem_end(), "Shrunk block is still mapped");
+    assert_filled(shrunk, 0x55, 1000);
+    sf_free(shrunk);
+    assert_all_freed(0);
+}
+
+Test(sfmm_trim_suite, trim_releases_free_pages, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(6 * PAGE_SZ);
+    cr_assert_not_null(x, "x is NULL!");
+    memset(x, 0x66, 6 * PAGE_SZ);
+    sf_free(x);
+    cr_assert_eq(sf_trim(16 * PAGE_SZ), 0, "Pages within keep were released");
+    size_t released = sf_trim(0);
+    cr_assert_geq(released, 4 * PAGE_SZ, "Only %zu bytes released", released);
+    cr_assert_eq(released % PAGE_SZ, 0, "Released bytes are not whole pages");
+    cr_assert_eq(sf_trim(0), 0, "Released pages were counted again");
+
+    char* y = sf_malloc(6 * PAGE_SZ);
+    cr_assert_not_null(y, "Heap is unusable after trim");
+    memset(y, 0x77, 6 * PAGE_SZ);
+    assert_filled(y, 0x77, 6 * PAGE_SZ);
+    sf_free(y);
+    cr_assert_geq(sf_trim(0), 4 * PAGE_SZ, "Pages used again were not released again");
+}
+
+Test(sfmm_slab_suite, slab_alloc_free, .timeout = TEST_TIMEOUT) {
+    size_t before = allocated_bytes();
+    sf_slab* slab = sf_slab_create(40, 64);
+    cr_assert_not_null(slab, "slab is NULL!");
+    void* objs[200];
+    for (int i = 0; i < 200; i++) {
+        objs[i] = sf_slab_alloc(slab);
+        cr_assert_not_null(objs[i], "Object %d is NULL!", i);
+        cr_assert_eq((uintptr_t)objs[i] % 64, 0, "Object %d is not aligned to 64 bytes", i);
+        memset(objs[i], i, 40);
+    }
+    sf_slab_free(slab, objs[17]);
+    cr_assert_eq(sf_slab_alloc(slab), objs[17], "Freed object was not reused");
+    sf_slab_destroy(slab);
+    assert_all_freed(before);
+
+    sf_errno = 0;
+    cr_assert_null(sf_slab_create(40, 48), "Alignment 48 was accepted");
+    cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_slab_suite, slab_double_free_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    sf_slab* slab = sf_slab_create(40, 0);
+    void* obj = sf_slab_alloc(slab);
+    sf_slab_alloc(slab);
+    sf_slab_free(slab, obj);
+    sf_slab_free(slab, obj);
+}
+
+Test(sfmm_arena_suite, arena_reset, .timeout = TEST_TIMEOUT) {
+    size_t before = allocated_bytes();
+    sf_arena* arena = sf_arena_create(0);
+    cr_assert_not_null(arena, "arena is NULL!");
+    char* first = sf_arena_alloc(arena, 100);
+    cr_assert_not_null(first, "first is NULL!");
+    for (int i = 0; i < 50; i++) {
+        char* ptr = sf_arena_alloc(arena, 200);
+        cr_assert_not_null(ptr, "Allocation %d is NULL!", i);
+        cr_assert_eq((uintptr_t)ptr % 16, 0, "Allocation %d is not aligned to 16 bytes", i);
+        memset(ptr, i, 200);
+    }
+    size_t used = allocated_bytes();
+    sf_arena_reset(arena);
+    cr_assert_lt(allocated_bytes(), used, "Reset kept every chunk");
+    char* again = sf_arena_alloc(arena, 100);
+    cr_assert_not_null(again, "again is NULL!");
+    sf_arena_destroy(arena);
+    assert_all_freed(before);
+}
+
+
+Test(sfmm_batch_suite, batch_malloc_free, .timeout = TEST_TIMEOUT) {
+    void* ptrs[40];
+    size_t before = allocated_bytes();
+    cr_assert_eq(sf_malloc_batch(100, 40, ptrs), 40, "Batch came back short");
+    for (int i = 0; i < 40; i++) {
+        cr_assert_eq((uintptr_t)ptrs[i] % 16, 0, "Block %d is not aligned to 16 bytes", i);
+        memset(ptrs[i], i, 100);
+    }
+    for (int i = 0; i < 40; i++) {
+        assert_filled(ptrs[i], i, 100);
+    }
+    sf_free_batch(ptrs, 40);
+    assert_all_freed(before);
+}
+
+Test(sfmm_batch_suite, batch_malloc_out_of_memory, .timeout = TEST_TIMEOUT) {
+    void* ptrs[100];
+    sf_errno = 0;
+    size_t count = sf_malloc_batch(4000, 100, ptrs);
+    cr_assert_lt(count, 100, "Batch larger than the heap succeeded");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+    sf_free_batch(ptrs, count);
+    cr_assert_eq(sf_malloc_batch(0, 10, ptrs), 0, "Batch of size 0 allocated blocks");
+}
+
+Test(sfmm_batch_suite, batch_free_duplicate_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    void* ptrs[4];
+    sf_malloc_batch(200, 3, ptrs);
+    ptrs[3] = ptrs[1];
+    sf_free_batch(ptrs, 4);
+}
+
+
+Test(sfmm_free_sized_suite, free_sized_matching_size, .timeout = TEST_TIMEOUT) {
+    size_t before = allocated_bytes();
+    char* small = sf_malloc(40);
+    char* large = sf_malloc(3000);
+    char* huge = sf_malloc(SF_MMAP_THRESHOLD + 100);
+    char* moved = sf_malloc(500);
+    cr_assert(small != NULL && large != NULL && huge != NULL && moved != NULL, "An allocation is NULL!");
+    moved = sf_realloc(moved, 900);
+    cr_assert_not_null(moved, "moved is NULL!");
+
+    sf_free_sized(small, 40);
+    sf_free_sized(large, 3000);
+    sf_free_sized(huge, SF_MMAP_THRESHOLD + 100);
+    sf_free_sized(moved, 900);
+    assert_all_freed(before);
+}
+
+Test(sfmm_free_sized_suite, free_sized_wrong_size_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    char* x = sf_malloc(3000);
+    sf_free_sized(x, 1000);
+}
+
+/*
+ * The preload library is only built by "make preload"; tests run from the project directory.
+ */
+#define PRELOAD_LIBRARY "bin/libsfmm.so"
+
+Test(sfmm_preload_suite, preload_runs_a_program, .timeout = TEST_TIMEOUT) {
+    if (access(PRELOAD_LIBRARY, R_OK) != 0) {
+        cr_skip_test("%s is not built", PRELOAD_LIBRARY);
+    }
+    FILE* out = popen("seq 20000 | LD_PRELOAD=" PRELOAD_LIBRARY " sort -rn | head -n 2", "r");
+    cr_assert_not_null(out, "popen failed!");
+    char line[2][16] = {"", ""};
+    cr_assert_not_null(fgets(line[0], sizeof(line[0]), out), "sort printed nothing");
+    cr_assert_not_null(fgets(line[1], sizeof(line[1]), out), "sort printed one line");
+    cr_assert_eq(pclose(out), 0, "sort failed under the preload library");
+    cr_assert(strcmp(line[0], "20000\n") == 0 && strcmp(line[1], "19999\n") == 0, "sort output is wrong");
+}
+
+Test(sfmm_calloc_suite, calloc_zeroes_reused_block, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(3000);
+    sf_malloc(1000);            // Takes the rest of the page, so y has to come out of x.
+    memset(x, 0xff, 3000);
+    sf_free(x);
+    char* y = sf_calloc(50, 10);
+    cr_assert_not_null(y, "y is NULL!");
+    cr_assert(y >= x && y < x + 3000, "y does not reuse x");
+    assert_filled(y, 0, 500);
+
+    char* huge = sf_calloc(2, SF_MMAP_THRESHOLD);
+    cr_assert_not_null(huge, "huge is NULL!");
+    assert_filled(huge, 0, 2 * SF_MMAP_THRESHOLD);
+    sf_free(huge);
+}
+
+Test(sfmm_calloc_suite, calloc_overflow, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert_null(sf_calloc(SIZE_MAX / 2, 3), "Overflowing nmemb * size was accepted");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+    sf_errno = 0;
+    cr_assert_null(sf_calloc(0, 10), "sf_calloc(0, 10) did not return NULL");
+    cr_assert_eq(sf_errno, 0, "sf_calloc(0, 10) set sf_errno");
+}
+
+
+Test(sfmm_stats_suite, stats_follow_the_heap, .timeout = TEST_TIMEOUT) {
+    struct sf_stats stats;
+    char* x = sf_malloc(1000);
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.allocated_bytes, 1008, "allocated_bytes is %zu", stats.allocated_bytes);
+    cr_assert_eq(stats.heap_bytes, (size_t)((char*)sf_mem_end() - (char*)sf_mem_start()), "heap_bytes is wrong");
+    cr_assert_eq(stats.heap_grows, 1, "heap_grows is %zu", stats.heap_grows);
+
+    size_t free_bytes = 0;
+    for (int i = 0; i < SF_NUM_CLASSES; i++) {
+        free_bytes += stats.free_list_bytes[i];
+    }
+    cr_assert_eq(stats.free_bytes, free_bytes, "free_bytes is not the sum of the free lists");
+    cr_assert_eq(stats.largest_free_block, stats.free_bytes, "One free block expected");
+    cr_assert_eq(stats.fragmentation, 0.0, "Heap with one free block is fragmented");
+
+    char* huge = sf_malloc(SF_MMAP_THRESHOLD);
+    sf_get_stats(&stats);
+    cr_assert_geq(stats.mapped_bytes, SF_MMAP_THRESHOLD, "mapped_bytes is %zu", stats.mapped_bytes);
+    cr_assert_eq(stats.allocated_bytes, 1008 + stats.mapped_bytes, "allocated_bytes is %zu", stats.allocated_bytes);
+    sf_free(huge);
+
+    sf_free(x);
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.mapped_bytes, 0, "mapped_bytes is %zu", stats.mapped_bytes);
+    cr_assert_eq(stats.allocated_bytes, 0, "allocated_bytes is %zu", stats.allocated_bytes);
+    cr_assert_geq(stats.peak_allocated_bytes, 1008 + SF_MMAP_THRESHOLD, "peak_allocated_bytes is %zu",
+                  stats.peak_allocated_bytes);
+#ifdef SF_DEFERRED_COALESCE
+    cr_assert_eq(stats.deferred_bytes, 1008, "deferred_bytes is %zu", stats.deferred_bytes);
+#else
+    cr_assert_geq(stats.coalesces, 1, "Freed block was not coalesced");
+#endif
+}
+
+#ifndef SF_THREAD_CACHE
+Test(sfmm_stats_suite, stats_count_quick_lists, .timeout = TEST_TIMEOUT) {
+    struct sf_stats stats;
+    void* x = sf_malloc(32);
+    sf_free(x);
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.quick_list_bytes, 48, "quick_list_bytes is %zu", stats.quick_list_bytes);
+    cr_assert_eq(stats.quick_list_misses, 1, "quick_list_misses is %zu", stats.quick_list_misses);
+    cr_assert_eq(sf_malloc(32), x, "Quick list block was not reused");
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.quick_list_hits, 1, "quick_list_hits is %zu", stats.quick_list_hits);
+    cr_assert_eq(stats.quick_list_bytes, 0, "quick_list_bytes is %zu", stats.quick_list_bytes);
+}
+#endif
+
+/*
+ * The replay tool is only built by "make bench". Its trace is written by hand, so it runs in every build. Tests
+ * may run in parallel, each one has a file of its own.
+ */
+#define REPLAY_TOOL "bin/sfmm_replay"
+#define REPLAY_FILE "/tmp/sfmm_tests_replay.trace"
+#define TRACE_FILE "/tmp/sfmm_tests.trace"
+
+Test(sfmm_trace_suite, replay_reads_a_trace, .timeout = TEST_TIMEOUT) {
+    if (access(REPLAY_TOOL, X_OK) != 0) {
+        cr_skip_test("%s is not built", REPLAY_TOOL);
+    }
+    sf_trace_record records[] = {
+        {.time = 1, .id = 0x1000, .size = 100, .op = SF_TRACE_MALLOC},
+        {.time = 2, .id = 0x2000, .arg = 0x1000, .size = 3000, .op = SF_TRACE_REALLOC},
+        {.time = 3, .id = 0x3000, .size = 48, .op = SF_TRACE_CALLOC},
+        {.time = 4, .id = 0x2000, .op = SF_TRACE_FREE},
+        {.time = 5, .id = 0x3000, .op = SF_TRACE_FREE},
+    };
+    FILE* trace = fopen(REPLAY_FILE, "w");
+    cr_assert_not_null(trace, "Trace file could not be created");
+    fwrite(SF_TRACE_MAGIC, 1, 8, trace);
+    fwrite(records, sizeof(records), 1, trace);
+    fclose(trace);
+
+    FILE* out = popen(REPLAY_TOOL " " REPLAY_FILE " sfmm", "r");
+    cr_assert_not_null(out, "popen failed!");
+    char line[128] = "";
+    cr_assert_not_null(fgets(line, sizeof(line), out), "Replay printed nothing");
+    while (fgetc(out) != EOF);
+    cr_assert_eq(pclose(out), 0, "Replay failed");
+    cr_assert(strncmp(line, "5 ops,", 6) == 0, "Replay read %s", line);
+}
+
+#ifdef SF_TRACE
+Test(sfmm_trace_suite, trace_records_calls, .timeout = TEST_TIMEOUT) {
+    setenv("SF_TRACE_FILE", TRACE_FILE, 1);     // Read when the first call is recorded.
+    char* x = sf_malloc(100);
+    char* y = sf_realloc(x, 3000);
+    char* z = sf_calloc(3, 16);
+    sf_free(y);
+    sf_free(z);
+    sf_trace_flush();
+
+    FILE* trace = fopen(TRACE_FILE, "r");
+    cr_assert_not_null(trace, "Trace file was not written");
+    char magic[8];
+    sf_trace_record records[6];
+    cr_assert_eq(fread(magic, 1, 8, trace), 8, "Trace file is empty");
+    cr_assert(memcmp(magic, SF_TRACE_MAGIC, 8) == 0, "Trace file has no magic");
+    cr_assert_eq(fread(records, sizeof(sf_trace_record), 6, trace), 5, "Trace does not hold 5 records");
+    fclose(trace);
+
+    cr_assert(records[0].op == SF_TRACE_MALLOC && records[0].id == (uintptr_t)x && records[0].size == 100,
+              "malloc record is wrong");
+    cr_assert(records[1].op == SF_TRACE_REALLOC && records[1].id == (uintptr_t)y && records[1].arg == (uintptr_t)x &&
+              records[1].size == 3000, "realloc record is wrong");
+    cr_assert(records[2].op == SF_TRACE_CALLOC && records[2].id == (uintptr_t)z && records[2].size == 48,
+              "calloc record is wrong");
+    cr_assert(records[3].op == SF_TRACE_FREE && records[3].id == (uintptr_t)y, "First free record is wrong");
+    cr_assert(records[4].op == SF_TRACE_FREE && records[4].id == (uintptr_t)z, "Second free record is wrong");
+    for (int i = 1; i < 5; i++) {
+        cr_assert_geq(records[i].time, records[i - 1].time, "Records are not in time order");
+    }
+}
+#endif
+
+/*
+ * Quick list tests need frees to reach the quick lists, which the thread cache would keep.
+ */
+#ifndef SF_THREAD_CACHE
+Test(sfmm_quick_list_suite, flush_keeps_newest_half, .timeout = TEST_TIMEOUT) {
+    char* ptrs[QUICK_LIST_MAX + 1];
+    for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+        ptrs[i] = sf_malloc(32);
+    }
+    for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+        sf_free(ptrs[i]);
+    }
+    // Full list of 5 flushed its 2 oldest blocks before the last one came in.
+    cr_assert_eq(sf_quick_lists[1].length, 4, "Quick list holds %d blocks", sf_quick_lists[1].length);
+    cr_assert_eq(sf_quick_lists[1].first, (sf_block*)(ptrs[QUICK_LIST_MAX] - 16), "Newest block is not first");
+    for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+        int allocated = (*(sf_header*)(ptrs[i] - 8)^MAGIC) & THIS_BLOCK_ALLOCATED;
+        cr_assert_eq(allocated == 0, i < 2, "Block %d was %s", i, allocated ? "kept" : "flushed");
+    }
+}
+
+Test(sfmm_quick_list_suite, capacity_grows_with_bursts, .timeout = TEST_TIMEOUT) {
+    // Bursts of 8 overflow a list of 5 and miss on the way back; after a few epochs the list holds a burst.
+    char* ptrs[8];
+    for (int round = 0; round < 24; round++) {
+        for (int i = 0; i < 8; i++) {
+            ptrs[i] = sf_malloc(32);
+        }
+        for (int i = 0; i < 8; i++) {
+            sf_free(ptrs[i]);
+        }
+    }
+    cr_assert_eq(sf_quick_lists[1].length, 8, "Quick list holds %d blocks", sf_quick_lists[1].length);
+}
+
+Test(sfmm_quick_list_suite, capacity_shrinks_when_unused, .timeout = TEST_TIMEOUT) {
+    // Only one of the list's blocks is ever used, the others sit there epoch after epoch.
+    char* ptrs[QUICK_LIST_MAX];
+    for (int i = 0; i < QUICK_LIST_MAX; i++) {
+        ptrs[i] = sf_malloc(32);
+    }
+    for (int i = 0; i < QUICK_LIST_MAX; i++) {
+        sf_free(ptrs[i]);
+    }
+    for (int i = 0; i < 8 * 64; i++) {
+        sf_free(sf_malloc(32));
+    }
+    cr_assert_eq(sf_quick_lists[1].length, 2, "Quick list holds %d blocks", sf_quick_lists[1].length);
+}
+#endif
+
+#ifdef SF_DEFERRED_COALESCE
+static int by_address(const void* a, const void* b) {
+    return *(char**)a < *(char**)b ? -1 : *(char**)a > *(char**)b;
+}
+
+Test(sfmm_deferred_suite, sweep_coalesces_pending_blocks, .timeout = TEST_TIMEOUT) {
+    // The middle three of six blocks are freed, the one below them stays allocated.
+    char* ptrs[6];
+    for (int i = 0; i < 6; i++) {
+        ptrs[i] = sf_malloc(1000);
+    }
+    qsort(ptrs, 6, sizeof(char*), by_address);
+    for (int i = 2; i < 5; i++) {
+        sf_free(ptrs[i]);
+    }
+    struct sf_stats stats;
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.deferred_bytes, 3 * 1008, "deferred_bytes is %zu", stats.deferred_bytes);
+    for (int i = 2; i < 5; i++) {
+        cr_assert((*(sf_header*)(ptrs[i] - 8)^MAGIC) & THIS_BLOCK_ALLOCATED, "Pending block %d is not parked", i);
+    }
+
+    sf_trim(16 * PAGE_SZ);              // Parked blocks go to the free lists, no page is released.
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.deferred_bytes, 0, "deferred_bytes is %zu", stats.deferred_bytes);
+    size_t header = *(sf_header*)(ptrs[2] - 8)^MAGIC;
+    cr_assert_eq(header & THIS_BLOCK_ALLOCATED, 0, "Swept block is allocated");
+    cr_assert_geq(header & ~0x7, 3 * 1008, "Swept blocks were not coalesced into one");
+}
+
+Test(sfmm_deferred_suite, pending_block_is_taken_back, .timeout = TEST_TIMEOUT) {
+    char* x = sf_malloc(1000);
+    sf_malloc(1000);
+    sf_free(x);
+    cr_assert_eq(sf_malloc(1000), x, "Pending block of the same size was not taken back");
+    struct sf_stats stats;
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.deferred_bytes, 0, "deferred_bytes is %zu", stats.deferred_bytes);
+}
+
+Test(sfmm_deferred_suite, pending_double_free_aborts, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    char* x = sf_malloc(1000);
+    sf_free(x);
+    sf_free(x);
+}
+#endif
+
+Test(sfmm_heap_suite, created_heap_is_separate, .timeout = TEST_TIMEOUT) {
+    sf_heap_t* heap = sf_heap_create(1 << 20);
+    cr_assert_not_null(heap, "heap is NULL!");
+    char* x = sf_heap_malloc(heap, 100000);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(x < (char*)sf_mem_start() || x >= (char*)sf_mem_end(), "Block of a created heap is in the default heap");
+    memset(x, 0x12, 100000);
+    sf_heap_free(heap, x);
+    cr_assert_eq(sf_mem_start(), sf_mem_end(), "Default heap was used");
+    sf_heap_destroy(heap);
+}
+
+
+/*
+ * Persistent heap tests make and remove these files, one per test as tests may run in parallel.
+ */
+#define PERSISTENT_HEAP_FILE "/tmp/sfmm_tests_heap.img"
+#define NOT_A_HEAP_FILE "/tmp/sfmm_tests_not_a_heap.img"
+
+typedef struct test_node {
+    struct test_node* next;
+    long value;
+} test_node;
+
+Test(sfmm_heap_suite, persistent_heap_reopen, .timeout = TEST_TIMEOUT) {
+    unlink(PERSISTENT_HEAP_FILE);
+    sf_heap_t* heap = sf_heap_open(PERSISTENT_HEAP_FILE, 1 << 24);
+    cr_assert_not_null(heap, "Could not create the heap file, sf_errno %d", sf_errno);
+    test_node* head = NULL;
+    for (long i = 0; i < 1000; i++) {
+        test_node* node = sf_heap_malloc(heap, sizeof(test_node) + (i % 5) * 24);
+        cr_assert_not_null(node, "Node %ld is NULL!", i);
+        node -> value = i;
+        node -> next = head;
+        head = node;
+    }
+    sf_heap_set_root(heap, 3, head);
+    sf_heap_destroy(heap);
+
+    heap = sf_heap_open(PERSISTENT_HEAP_FILE, 0);
+    cr_assert_not_null(heap, "Could not reopen the heap file, sf_errno %d", sf_errno);
+    cr_assert_null(sf_heap_get_root(heap, 0), "Root 0 was never set");
+    long expected = 999;
+    for (test_node* node = sf_heap_get_root(heap, 3); node != NULL; node = node -> next) {
+        cr_assert_eq(node -> value, expected, "Node holds %ld instead of %ld", node -> value, expected);
+        expected--;
+    }
+    cr_assert_eq(expected, -1, "List lost nodes");
+
+    // Blocks of the file are still valid blocks of the heap.
+    head = sf_heap_get_root(heap, 3);
+    sf_heap_set_root(heap, 3, head -> next);
+    sf_heap_free(heap, head);
+    cr_assert_not_null(sf_heap_malloc(heap, 5000), "Reopened heap cannot allocate");
+    sf_errno = 0;
+    cr_assert_null(sf_heap_get_root(heap, SF_HEAP_ROOTS), "Root out of range");
+    cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+    sf_heap_destroy(heap);
+    unlink(PERSISTENT_HEAP_FILE);
+}
+
+
+Test(sfmm_heap_suite, persistent_heap_refuses_other_files, .timeout = TEST_TIMEOUT) {
+    FILE* file = fopen(NOT_A_HEAP_FILE, "w");
+    cr_assert_not_null(file, "Could not create the file");
+    for (int i = 0; i < PAGE_SZ; i++) {
+        fputc(0x5a, file);
+    }
+    fclose(file);
+    sf_errno = 0;
+    cr_assert_null(sf_heap_open(NOT_A_HEAP_FILE, 0), "File without a heap was opened");
+    cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+    unlink(NOT_A_HEAP_FILE);
+}
+
+#ifdef SF_HUGE_PAGES
+Test(sfmm_heap_suite, huge_pages_align_created_heap, .timeout = TEST_TIMEOUT) {
+    sf_heap_t* heap = sf_heap_create(16 << 20);
+    cr_assert_not_null(heap, "heap is NULL!");
+    cr_assert_eq((uintptr_t)heap_start(heap) % SF_HUGE_EXTENT, 0, "Heap does not start on an extent");
+    char* x = sf_heap_malloc(heap, 3 * SF_HUGE_EXTENT);
+    cr_assert_not_null(x, "x is NULL!");
+    memset(x, 0x34, 3 * SF_HUGE_EXTENT);
+
+    // Kernel may back the extents with huge pages or not, but never more than the heap.
+    size_t huge_bytes = sf_huge_page_bytes(heap);
+    cr_assert_eq(huge_bytes % SF_HUGE_EXTENT, 0, "%zu bytes in huge pages", huge_bytes);
+    cr_assert_leq(huge_bytes, (size_t)((char*)heap_end(heap) - (char*)heap_start(heap)) + SF_HUGE_EXTENT,
+                  "%zu bytes in huge pages", huge_bytes);
+    sf_heap_destroy(heap);
+}
+#endif
+
+int free_list_index(size_t size);       // sfmm.c, not in any header.
+
+Test(sfmm_free_list_suite, free_list_index_bounds, .timeout = TEST_TIMEOUT) {
+    // Each power of two range is split into SF_CLASS_STEPS classes, none narrower than a row.
+    size_t limit = 32;
+    for (int i = 0; i < SF_NUM_CLASSES - 1; i++) {
+        cr_assert_eq(CLASS_LIMIT(i), limit, "Class %d ends at %zu, not %zu", i, CLASS_LIMIT(i), limit);
+        cr_assert_eq(free_list_index(limit), i, "Block of %zu bytes is not in list %d", limit, i);
+        cr_assert_eq(free_list_index(limit + 16), i + 1, "Block of %zu bytes is not in list %d", limit + 16, i + 1);
+        size_t step = ((size_t)1 << (63 - __builtin_clzl(limit))) / SF_CLASS_STEPS;
+        limit += step > 16 ? step : 16;
+    }
+    cr_assert_eq(free_list_index((size_t)1 << 40), SF_NUM_CLASSES - 1, "Huge block is not in the last list");
+}
+
+Test(sfmm_free_list_suite, search_skips_empty_lists, .timeout = TEST_TIMEOUT) {
+    // One free block over most of the heap. Blocks are cut from its end, so each lies below the one before.
+    void* first = sf_malloc(20000);
+    void* second = sf_malloc(20000);
+    sf_free(first);
+    sf_free(second);
+    char* a = sf_malloc(300);           // Block of 320 bytes.
+    sf_malloc(200);
+    char* b = sf_malloc(3000);          // Block of 3008 bytes.
+    sf_malloc(200);
+    sf_free(a);
+    sf_free(b);
+#ifdef SF_DEFERRED_COALESCE
+    sf_trim(16 * PAGE_SZ);              // Parked blocks go to the free lists, no page is released.
+#endif
+
+    // Lists from 1008 bytes up to b's are empty, the first block that fits is b.
+    char* x = sf_malloc(1000);
+    cr_assert(x >= b && x < b + 3000, "Block of 1008 bytes did not come from the next non-empty list");
+    // List of 256 byte blocks is empty, a is in the lowest list that fits.
+    char* y = sf_malloc(250);
+    cr_assert(y >= a && y < a + 300, "Block of 256 bytes did not come from the lowest non-empty list");
+}
+
+Test(sfmm_free_list_suite, last_list_best_fit, .timeout = TEST_TIMEOUT) {
+    // One free block over most of the heap. Blocks are cut from its end, so each lies below the one before.
+    void* first = sf_malloc(20000);
+    void* second = sf_malloc(20000);
+    sf_free(first);
+    sf_free(second);
+    char* a = sf_malloc(9000);
+    sf_malloc(200);
+    char* b = sf_malloc(10000);
+    sf_malloc(200);
+    char* c = sf_malloc(12000);
+    sf_malloc(200);
+    sf_free(a);
+    sf_free(b);
+    sf_free(c);
+#ifdef SF_DEFERRED_COALESCE
+    sf_trim(16 * PAGE_SZ);              // Parked blocks go to the free lists, no page is released.
+#endif
+
+    // First fit would take c, the block freed last.
+    char* x = sf_malloc(9500);
+    cr_assert(x >= b && x < b + 10000, "Block did not come from the smallest one that fits");
+    char* y = sf_malloc(9000);
+    cr_assert_eq(y, a, "Block of the exact size was not taken whole");
+}
+
+Test(sfmm_memalign_suite, memalign_alignments, .timeout = TEST_TIMEOUT) {
+    for (size_t align = 32; align <= 4096; align *= 2) {
+        char* x = sf_memalign(100, align);
+        cr_assert_not_null(x, "sf_memalign(100, %zu) is NULL!", align);
+        cr_assert_eq((uintptr_t)x % align, 0, "Block is not aligned to %zu bytes", align);
+        memset(x, 0x44, 100);
+        sf_free(x);
+    }
+    assert_all_freed(0);
+}
+
+Test(sfmm_memalign_suite, memalign_invalid_alignment, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert_null(sf_memalign(100, 48), "Alignment 48 was accepted");
+    cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+    sf_errno = 0;
+    cr_assert_null(sf_memalign(100, 16), "Alignment below the minimum block size was accepted");
+    cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+    sf_errno = 0;
+    cr_assert_null(sf_memalign(SIZE_MAX - 64, 64), "Oversized request was accepted");
+    cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+#ifndef SF_THREAD_CACHE
+Test(sfmm_memalign_suite, memalign_from_quick_list, .timeout = TEST_TIMEOUT) {
+    // Payloads of four neighbouring 112 byte blocks fall on every multiple of 16 modulo 64 once.
+    void* ptrs[4];
+    for (int i = 0; i < 4; i++) {
+        ptrs[i] = sf_malloc(100);
+    }
+    for (int i = 0; i < 4; i++) {
+        sf_free(ptrs[i]);
+    }
+    void* x = sf_memalign(100, 64);
+    int found = 0;
+    for (int i = 0; i < 4; i++) {
+        found |= x == ptrs[i];
+    }
+    cr_assert(found, "Aligned block was not taken from the quick list");
+}
+#endif
+
+#if defined(SF_THREAD_CACHE) || defined(SF_LOCK_STRIPED)
+#define THREAD_TEST_THREADS 4
+#define THREAD_TEST_LIVE 8
+
+/*
+ * Allocates and frees blocks of sizes across the quick lists and several free lists, checking that nobody else
+ * wrote into them in between.
+ */
+static void* churn(void* arg) {
+    int id = (int)(intptr_t)arg;
+    char* live[THREAD_TEST_LIVE] = {NULL};
+    size_t sizes[THREAD_TEST_LIVE];
+    unsigned int seed = id + 1;
+    for (int i = 0; i < 4000; i++) {
+        int slot = rand_r(&seed) % THREAD_TEST_LIVE;
+        if (live[slot] != NULL) {
+            assert_filled(live[slot], id, sizes[slot]);
+            sf_free(live[slot]);
+        }
+        sizes[slot] = 16 + rand_r(&seed) % 400;
+        live[slot] = sf_malloc(sizes[slot]);
+        cr_assert_not_null(live[slot], "Allocation of %zu bytes failed", sizes[slot]);
+        memset(live[slot], id, sizes[slot]);
+    }
+    for (int slot = 0; slot < THREAD_TEST_LIVE; slot++) {
+        assert_filled(live[slot], id, sizes[slot]);
+        sf_free(live[slot]);
+    }
+    return NULL;
+}
+
+Test(sfmm_thread_suite, concurrent_malloc_free, .timeout = TEST_TIMEOUT) {
+    pthread_t threads[THREAD_TEST_THREADS];
+    for (int i = 0; i < THREAD_TEST_THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn, (void*)(intptr_t)(i + 1));
+    }
+    for (int i = 0; i < THREAD_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    cr_assert_eq(allocated_bytes(), 0, "allocated_bytes is %zu", allocated_bytes());
+}
+#endif
+
+#ifdef SF_THREAD_CACHE
+#define CACHE_TEST_BLOCKS 128
+
+struct cache_test {
+    size_t after_first;         // allocated_bytes() after the first allocation of the thread.
+    size_t after_free;          // allocated_bytes() once the thread freed everything.
+    void* ptrs[CACHE_TEST_BLOCKS];
+    int reused;                 // Blocks allocated after a remote free that came back from the inbox.
+    pthread_t freer;            // Thread freeing the blocks while their owner exits.
+};
+
+static void* refill_and_drain(void* arg) {
+    struct cache_test* test = arg;
+    test -> ptrs[0] = sf_malloc(48);
+    test -> after_first = allocated_bytes();
+    for (int i = 1; i < CACHE_TEST_BLOCKS; i++) {
+        test -> ptrs[i] = sf_malloc(48);
+    }
+    for (int i = 0; i < CACHE_TEST_BLOCKS; i++) {
+        sf_free(test -> ptrs[i]);
+    }
+    test -> after_free = allocated_bytes();
+    return NULL;
+}
+
+Test(sfmm_tcache_suite, tcache_refill_and_drain, .timeout = TEST_TIMEOUT) {
+    struct cache_test test;
+    pthread_t thread;
+    pthread_create(&thread, NULL, refill_and_drain, &test);
+    pthread_join(thread, NULL);
+    cr_assert_gt(test.after_first, 64, "First allocation did not refill a batch");
+    cr_assert_lt(test.after_free, CACHE_TEST_BLOCKS * 64, "Cache did not drain past its budget");
+    cr_assert_eq(allocated_bytes(), 0, "Exiting thread kept its cache");
+}
+
+static void* free_remote(void* arg) {
+    struct cache_test* test = arg;
+    for (int i = 0; i < 16; i++) {
+        sf_free(test -> ptrs[i]);
+    }
+    return NULL;
+}
+
+static void* remote_handoff(void* arg) {
+    struct cache_test* test = arg;
+    for (int i = 0; i < 16; i++) {
+        test -> ptrs[i] = sf_malloc(48);
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, free_remote, test);
+    pthread_join(thread, NULL);
+    test -> reused = 0;
+    for (int i = 0; i < 16; i++) {
+        void* ptr = sf_malloc(48);
+        for (int j = 0; j < 16; j++) {
+            test -> reused += ptr == test -> ptrs[j];
+        }
+    }
+    return NULL;
+}
+
+Test(sfmm_tcache_suite, tcache_remote_handoff, .timeout = TEST_TIMEOUT) {
+    struct cache_test test;
+    pthread_t thread;
+    pthread_create(&thread, NULL, remote_handoff, &test);
+    pthread_join(thread, NULL);
+    cr_assert_eq(test.reused, 16, "Only %d blocks came back to their owner", test.reused);
+    cr_assert_eq(allocated_bytes(), 16 * 64, "allocated_bytes is %zu", allocated_bytes());
+}
+
+static void* exit_while_freed(void* arg) {
+    struct cache_test* test = arg;
+    for (int i = 0; i < 16; i++) {
+        test -> ptrs[i] = sf_malloc(48);
+    }
+    pthread_create(&test -> freer, NULL, free_remote, test);
+    return NULL;
+}
+
+Test(sfmm_tcache_suite, tcache_owner_exits_during_remote_frees, .timeout = TEST_TIMEOUT) {
+    // Frees racing the owner's exit either reach its inbox before it closes or stay with the freeing thread.
+    for (int round = 0; round < 200; round++) {
+        struct cache_test test;
+        pthread_t thread;
+        pthread_create(&thread, NULL, exit_while_freed, &test);
+        pthread_join(thread, NULL);
+        pthread_join(test.freer, NULL);
+        cr_assert_eq(allocated_bytes(), 0, "Round %d lost %zu bytes", round, allocated_bytes());
+    }
+}
+#endif